@@ -8,6 +8,7 @@
 #include <syscall.h>
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * System call handler.
@@ -112,6 +113,13 @@ mips_syscall(struct trapframe *tf)
 	    	err = sys_execv((const char *) tf->tf_a0, (char **) tf->tf_a1);
 	    	break;
 
+#endif
+#if OPT_A3
+
+	    case SYS_sbrk:
+	    	retval = (int32_t) sys_sbrk(tf->tf_a0, &err);
+	    	break;
+
 #endif
  
 	    default:
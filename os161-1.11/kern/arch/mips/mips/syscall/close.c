@@ -61,6 +61,6 @@ void _close(struct fd *file_table[], int fd) {
 	vfs_close(file_table[fd]->node);
 
 	// free file_table entry
-	kfree(file_table[fd]);
+	objcache_free(&fd_cache, file_table[fd]);
 	file_table[fd] = NULL;
 }
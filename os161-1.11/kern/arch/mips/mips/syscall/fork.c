@@ -7,10 +7,48 @@
 #include <kern/errno.h>
 #include <machine/trapframe.h>
 #include <lib.h>
+#include <objcache.h>
 
 
 struct process *runningprocesses[MAX_PROCESSES];
 
+/** Makes the locks and CV of a process, which stay with it while it is
+ * cached so that forking doesn't have to make them each time. **/
+static int process_ctor(void *obj) {
+	struct process *process = obj;
+
+	process->p_exitcv = cv_create("");
+	if (process->p_exitcv == NULL) {
+		return ENOMEM;
+	}
+
+	process->p_exitlock = lock_create("");
+	if (process->p_exitlock == NULL) {
+		cv_destroy(process->p_exitcv);
+		return ENOMEM;
+	}
+
+	process->p_file_table_lock = lock_create("file_table_lock");
+	if (process->p_file_table_lock == NULL) {
+		lock_destroy(process->p_exitlock);
+		cv_destroy(process->p_exitcv);
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static void process_dtor(void *obj) {
+	struct process *process = obj;
+
+	lock_destroy(process->p_file_table_lock);
+	lock_destroy(process->p_exitlock);
+	cv_destroy(process->p_exitcv);
+}
+
+static struct objcache process_cache =
+	OBJCACHE_INITIALIZER("process", struct process, process_ctor, process_dtor);
+
 
 /**
  * Entry function for the new process.
@@ -54,27 +92,9 @@ int process_create(struct process **dst) {
 }
 
 int process_create_for_id(pid_t pid, struct process **dst, struct lock *p_lock) {
-	*dst = kmalloc(sizeof(struct process));
-	if (dst == NULL) {
-		if (p_lock != NULL) {
-			lock_release(p_lock);
-		}
-		return ENOMEM;
-	}
-
-	(*dst)->p_exitcv = cv_create("");
-	if ((*dst)->p_exitcv == NULL) {
-		kfree(*dst);
-		if (p_lock != NULL) {
-			lock_release(p_lock);
-		}
-		return ENOMEM;
-	}
-
-	(*dst)->p_exitlock = lock_create("");
-	if ((*dst)->p_exitlock == NULL) {
-		kfree((*dst)->p_exitcv);
-		kfree(*dst);
+	// comes with its locks and CV already made
+	*dst = objcache_alloc(&process_cache);
+	if (*dst == NULL) {
 		if (p_lock != NULL) {
 			lock_release(p_lock);
 		}
@@ -92,16 +112,7 @@ int process_create_for_id(pid_t pid, struct process **dst, struct lock *p_lock)
 		lock_release(p_lock);
 	}
 
-	// initialize the file table and its lock
-	(*dst)->p_file_table_lock = lock_create("file_table_lock");
-	if ((*dst)->p_file_table_lock == NULL) {
-		lock_destroy((*dst)->p_exitlock);
-		cv_destroy((*dst)->p_exitcv);
-		kfree(*dst);
-
-		return ENOMEM;
-	}
-
+	// initialize the file table
 	int i;
 	for (i = 0; i < MAX_FILE_HANDLES; i++) {
 		(*dst)->p_file_table[i] = NULL;
@@ -117,12 +128,6 @@ void process_remove(pid_t pid) {
 
 	lock_acquire(process_lock);
 
-	lock_destroy(process->p_exitlock);
-	cv_destroy(process->p_exitcv);
-
-	// destroy the file table
-	lock_destroy(process->p_file_table_lock);
-
 	// close unclosed files
 	int i;
 	for (i = FIRST_FILE_HANDLE; i < MAX_FILE_HANDLES; i++) {
@@ -131,7 +136,8 @@ void process_remove(pid_t pid) {
 		}
 	}
 
-	kfree(process);
+	// the locks and CV go back to the cache with it
+	objcache_free(&process_cache, process);
 	runningprocesses[pid] = NULL;
 
 	lock_release(process_lock);
@@ -165,7 +171,7 @@ pid_t sys_fork(struct trapframe *tf, int *errorcode) {
 
 	if (*errorcode != 0) {
 		kfree(newTrapFrame);
-		kfree(newAddrspace);
+		as_destroy(newAddrspace);
 		return -1;
 	}
 
@@ -199,7 +205,7 @@ pid_t sys_fork(struct trapframe *tf, int *errorcode) {
 		lock_release(process_lock);
 
 		kfree(newTrapFrame);
-		kfree(newAddrspace);
+		as_destroy(newAddrspace);
 		process_remove(pid);
 
 		return -1;
@@ -214,7 +220,7 @@ pid_t sys_fork(struct trapframe *tf, int *errorcode) {
 	// If thread_fork has failed we want to leave immediately
 	if (*errorcode != 0) {
 		kfree(newTrapFrame);
-		kfree(newAddrspace);
+		as_destroy(newAddrspace);
 		process_remove(pid);
 		return -1;
 	}
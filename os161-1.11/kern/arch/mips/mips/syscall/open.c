@@ -10,6 +10,8 @@
 #include <synch.h>
 #include <vfs.h>
 
+struct objcache fd_cache = OBJCACHE_INITIALIZER("fd", struct fd, NULL, NULL);
+
 int sys_open(const char *filename, int flags, int mode, int *err) {
 
 	// make sure that we've been given a valid pointer for the file name
@@ -66,7 +68,7 @@ int _open(struct fd *file_table[], int fd, const char *filename, int flags, int
 	assert(fd >= 0 && fd < MAX_FILE_HANDLES);
 	assert(file_table[fd] == NULL);
 
-	file_table[fd] = (struct fd *) kmalloc(sizeof(struct fd));
+	file_table[fd] = (struct fd *) objcache_alloc(&fd_cache);
 
 	file_table[fd]->name = kstrdup(filename);
 	file_table[fd]->flags = 0x3 & flags; // strip out flags that aren't O_WRONLY, O_RDONLY, O_RDWR
@@ -82,7 +84,7 @@ int _open(struct fd *file_table[], int fd, const char *filename, int flags, int
 	// free the file_table entry if an error occurred (if we don't this entry will never be usable again)
 	if (err != 0) {
 		kfree(file_table[fd]->name);
-		kfree(file_table[fd]);
+		objcache_free(&fd_cache, file_table[fd]);
 
 		file_table[fd] = NULL;
 	}
@@ -6,14 +6,21 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <objcache.h>
 #include <process.h>
 #include <synch.h>
+#include <textcache.h>
 #include <uio.h>
 #include <vfs.h>
 #include <vnode.h>
 
+#include "opt-A3.h"
+
 static struct uio *constructUio(enum uio_rw operation, void *buffer, size_t length, size_t file_offset);
 
+// every read and write makes a uio and frees it again
+static struct objcache uio_cache = OBJCACHE_INITIALIZER("uio", struct uio, NULL, NULL);
+
 int sys_read(int fd, void *buf, size_t buflen, int *err) {
 
 	DEBUG(DB_FSYSCALL, "Reading from file handle %d in process %d\n", fd, curthread->t_pid);
@@ -73,7 +80,7 @@ int sys_read(int fd, void *buf, size_t buflen, int *err) {
 	int length = input->uio_offset - file_table[fd]->position;
 
 	// get rid of the input
-	kfree(input);
+	objcache_free(&uio_cache, input);
 
 	if (*err == 0) {
 		file_table[fd]->position += length;
@@ -158,11 +165,16 @@ int sys_write(int fd, const void *buf, size_t nbytes, int *err) {
 	int length = output->uio_offset - file_table[fd]->position;
 
 	// get rid of the output
-	kfree(output);
+	objcache_free(&uio_cache, output);
 
 	if (*err == 0) {
 		file_table[fd]->position += length;
 
+#if OPT_A3
+		// cached pages of a program that was just written are stale
+		textcache_invalidate(file_table[fd]->node);
+#endif
+
 		lock_release(file_table_lock);
 
 		lock_release(process_lock);
@@ -185,7 +197,7 @@ error:
 }
 
 static struct uio *constructUio(enum uio_rw operation, void *buffer, size_t length, size_t file_offset) {
-	struct uio *ret = kmalloc(sizeof(struct uio));
+	struct uio *ret = objcache_alloc(&uio_cache);
 
 	ret->uio_iovec.iov_kbase = buffer;
 	ret->uio_iovec.iov_len = length;
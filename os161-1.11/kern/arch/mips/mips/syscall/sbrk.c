@@ -0,0 +1,20 @@
+#include <syscall.h>
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <thread.h>
+#include <curthread.h>
+
+// Moves the end of the heap by change bytes and returns where it was
+// before, so a positive change returns the start of the new memory.
+void *sys_sbrk(int change, int *err) {
+	vaddr_t oldbreak;
+
+	*err = as_sbrk(curthread->t_vmspace, change, &oldbreak);
+	if (*err) {
+		return (void *) -1;
+	}
+
+	return (void *) oldbreak;
+}
@@ -8,7 +8,9 @@
 
 #include "opt-A2.h"
 
-#define MAX_REGIONS		(3)
+// the number of regions an address space has room for at first, which is
+// doubled whenever it runs out
+#define AS_REGIONS_INITIAL	(4)
 
 struct vnode;
 
@@ -39,8 +41,33 @@ struct addrspace {
 #else
 	struct pagetable *as_pt;
 	struct vnode *as_v;
-	struct region as_regions[MAX_REGIONS];
+
+	// the regions sorted by address, so they can be binary searched
+	struct region *as_regions;
 	int as_region_count;
+	int as_region_max;
+
+	// where the heap region starts, or 0 before it is set up
+	vaddr_t as_heapbase;
+
+	// the ID the address space's TLB entries are tagged with, which is
+	// only good while as_asidgen matches the current ASID generation
+	u_int32_t as_asid;
+	u_int32_t as_asidgen;
+
+	// the number of user pages in memory that the address space maps, and
+	// how many it may keep before its pages are the first to be evicted,
+	// which page-fault-frequency control in vm_fault adjusts
+	unsigned int as_resident;
+	unsigned int as_allowance;
+
+	// when the address space last had a page fault (see vm_fault)
+	u_int32_t as_lastfault;
+
+	// nonzero while the kernel is working on the address space's pages
+	// (such as in vm_fault) and may be holding on to their frames, so
+	// memory compaction has to leave them where they are
+	int as_busy;
 #endif
 };
 
@@ -77,6 +104,8 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The heap is set up here as well, just past the other
+ *                regions.
  */
 
 struct addrspace *as_create(void);
@@ -96,6 +125,21 @@ int		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 paddr_t   		as_get_paddr(struct addrspace *as, vaddr_t vaddr);
 
+/*
+ * as_findregion - find the region with the page at VADDR in it, or NULL
+ *                if there is none. A page partly in a region counts.
+ *
+ * as_isstack - return nonzero if VADDR is in the part of the address
+ *                space the stack may grow into.
+ *
+ * as_sbrk - move the end of the heap by CHANGE bytes, handing back where
+ *                it was in OLDBREAK. Pages the heap no longer covers are
+ *                freed.
+ */
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_isstack(vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, int change, vaddr_t *oldbreak);
+
 #if OPT_A2
 int 		as_valid_ptr(vaddr_t ptr);
 #endif
@@ -5,37 +5,154 @@
 
 struct lock;
 
+// the number of block sizes (powers of two pages) the buddy allocator tracks
+#define COREMAP_ORDERS 12
+
+// page replacement policies used to pick a page to swap out
+#define COREMAP_EVICT_RANDOM 0
+#define COREMAP_EVICT_CLOCK 1
+#define COREMAP_EVICT_COUNT 2
+
+// the page replacement policy the kernel starts with. The evict menu
+// command switches it so the swapfile writes (VMSTAT_SWAP_FILE_WRITE) of
+// each can be compared on the same workload, as test-vm-evict-policy does
+#define COREMAP_EVICTION_POLICY COREMAP_EVICT_CLOCK
+
 enum page_state {
 	FREE,
 	ALLOCATED,
 	FIXED
 };
 
-struct coremap_page {
-	// the address space and virtual address to which the page is mapped
+// The state, flags and counts of a frame are packed into one word:
+//   bits 0-1    the enum page_state of the frame
+//   bit 2       set if the page has been used since the clock hand last
+//               passed it
+//   bit 3       set if the page has been written since it was loaded, so it
+//               has to be written to the swapfile rather than just dropped
+//   bits 4-15   for the first page of an allocation, the number of pages
+//               allocated with it, and for the first page of a free block,
+//               one more than its order (the block is 2^order pages long)
+//               this will be 0 for every other page
+//   bits 16-31  the number of references to the page, which is one for
+//               each page table mapping it plus any the kernel holds (such
+//               as the text cache) and 0 if the page is free
+#define COREMAP_STATE_MASK		(0x00000003)
+#define COREMAP_STATE_SHIFT		(0)
+#define COREMAP_REFERENCED_MASK	(0x00000004)
+#define COREMAP_REFERENCED_SHIFT	(2)
+#define COREMAP_DIRTY_MASK		(0x00000008)
+#define COREMAP_DIRTY_SHIFT		(3)
+#define COREMAP_SIZE_MASK		(0x0000FFF0)
+#define COREMAP_SIZE_SHIFT		(4)
+#define COREMAP_REFCOUNT_MASK	(0xFFFF0000)
+#define COREMAP_REFCOUNT_SHIFT	(16)
+
+// the most pages of reverse mappings for shared pages that are taken from
+// the coremap as they are needed; pages shared by more mappings than fit
+// aren't swapped
+#define COREMAP_RMAP_MAXPAGES 64
+
+// The mappings of an allocated page. Almost every page is mapped by at most
+// one page table, whose address space and virtual address are kept right
+// here. A page mapped more than once has a NULL addrspace and the first of
+// a chain of reverse mappings instead.
+struct coremap_mappings {
 	struct addrspace *addrspace;
-	vaddr_t addr;
+	union {
+		// the page-aligned virtual address with SWP_PAGE or SWP_TABLE set
+		vaddr_t addr;
+		// the first reverse mapping, or -1 if the page isn't mapped
+		int rmap;
+	} to;
+};
+
+struct coremap_page {
+	u_int32_t flags;
 
-	// the number of pages allocated with this one
-	// this will be 0 if it's not the first page of an allocation
-	unsigned long page_count;
+	// for an allocated page, the swapfile page still holding an up to
+	// date copy of a clean page that was swapped back in, or -1 for none
+	int swapslot;
+
+	union {
+		// for the first page of a free block, the blocks before and
+		// after it in the free list of its order by page index or -1
+		struct {
+			int next;
+			int prev;
+		} free;
+
+		// for an allocated page, what maps it
+		struct coremap_mappings used;
+	} u;
+};
 
-	// the state of the page
-	enum page_state state;
+// One address space and virtual address mapping a shared page, chained
+// together with the other mappings of the same page.
+struct coremap_rmap {
+	struct addrspace *addrspace;
+	// the page-aligned virtual address with SWP_PAGE or SWP_TABLE set
+	vaddr_t addr;
+	// the next mapping of the page or the next unused entry or -1
+	int next;
 };
 
 void coremap_bootstrap();
 void coremap_shutdown();
 
+// Print the free blocks of each order
+void coremap_printstats();
+
 paddr_t coremap_getpages(unsigned long npages);
 void coremap_freepages(paddr_t paddr);
 
+// Get a single free page without sleeping or making room for it. Returns
+// NULL if none is free or the coremap is busy. Interrupts must be off.
+paddr_t coremap_trygetpage();
+
+// Get the number of free pages in the coremap
+unsigned int coremap_getfreecount();
+
+// Swap out up to maxpages pages together to make room, returning how many were
+int coremap_evictpages(int maxpages);
+
 // Get and set whether a page is swappable or not
 int coremap_ispagefixed(paddr_t paddr);
 void coremap_setpagefixed(paddr_t paddr, int fixed);
 
-// Get and set the addrspace and vaddr of a page
+// Get the first addrspace and vaddr a page is mapped at, or replace every
+// mapping of the page with the one given (none if addrspace is NULL)
 void coremap_getpagevaddr(paddr_t paddr, struct addrspace **addrspace, vaddr_t *vaddr);
 void coremap_setpagevaddr(paddr_t paddr, struct addrspace *addrspace, vaddr_t vaddr);
 
+// Record another mapping of a page, whose reference the caller has already
+// taken with coremap_sharepage. If there is no room to record it the page
+// just can't be swapped until some of its mappings are gone.
+void coremap_addmapping(paddr_t paddr, struct addrspace *addrspace, vaddr_t vaddr);
+
+// Drop the mapping of a page by an address space along with its reference,
+// freeing the page like coremap_freepages if it was the last one. An address
+// space maps a page at most once.
+void coremap_unmappage(paddr_t paddr, struct addrspace *addrspace);
+
+// Select the page replacement policy by name ("random" or "clock"),
+// returning 0 on success or EINVAL, and get the name of the one in use
+int coremap_setpolicy(const char *name);
+const char *coremap_getpolicy();
+
+// Note that a page has been used, giving it a second chance at eviction
+void coremap_setpagereferenced(paddr_t paddr);
+
+// Note that a page has been written and can't be dropped without saving it
+void coremap_setpagedirty(paddr_t paddr);
+
+// Note that a page was read back from the swapfile page index, which is kept
+// so that the page can be evicted again without writing it until it is dirty
+void coremap_setswapslot(paddr_t paddr, int index);
+
+// Add another sharer to a page and get the number of sharers. A shared
+// page is only really freed once every sharer has freed it.
+void coremap_sharepage(paddr_t paddr);
+unsigned int coremap_getrefcount(paddr_t paddr);
+
 #endif
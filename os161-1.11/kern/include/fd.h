@@ -2,6 +2,7 @@
 #define _FD_H_
 
 #include <types.h>
+#include <objcache.h>
 //#include <synch.h>
 
 #define MAX_FILE_HANDLES 32
@@ -15,6 +16,10 @@ struct fd {
 	struct vnode *node;
 };
 
+// open files are made and freed by every open and close, so they are
+// cached rather than going back to kmalloc each time
+extern struct objcache fd_cache;
+
 //// TODO move this to the process
 //extern struct lock *file_table_lock;
 //extern struct fd *file_table[MAX_FILE_HANDLES];
@@ -0,0 +1,58 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Cache of constructed kernel objects of one type.
+ *
+ * Freed objects are kept, still constructed, on a stack that the next
+ * allocation pops, so objects that are made and thrown away all the time
+ * don't go through kmalloc's search of its pages or redo their setup.
+ * Objects only come from kmalloc, and get the constructor run on them,
+ * when the stack is empty, and only go back to kfree, after the
+ * destructor, when it is full. An object must be freed in the state the
+ * constructor leaves it in.
+ *
+ * Caches are defined statically with OBJCACHE_INITIALIZER so they can be
+ * used from the first thread onwards.
+ *
+ * Functions:
+ *     objcache_alloc  - get an object. Returns NULL if out of memory or the
+ *                       constructor fails.
+ *     objcache_free   - give an object back to its cache. Does nothing if
+ *                       passed NULL.
+ *     objcache_printstats - print how well each cache that has been used
+ *                       is doing.
+ *
+ * The constructor returns 0 or an error code; either hook may be NULL.
+ */
+
+/* Most freed objects a cache keeps */
+#define OBJCACHE_DEPTH 32
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	/* Constructed objects ready to hand out */
+	void *oc_free[OBJCACHE_DEPTH];
+	unsigned oc_nfree;
+
+	/* Allocations, and those that popped a cached object */
+	unsigned oc_allocs;
+	unsigned oc_hits;
+
+	/* Caches that have been used, for objcache_printstats */
+	struct objcache *oc_next;
+	int oc_listed;
+};
+
+#define OBJCACHE_INITIALIZER(name, type, ctor, dtor) \
+	{ name, sizeof(type), ctor, dtor, { NULL }, 0, 0, 0, NULL, 0 }
+
+void *objcache_alloc(struct objcache *oc);
+void  objcache_free(struct objcache *oc, void *obj);
+void  objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
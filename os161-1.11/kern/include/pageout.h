@@ -0,0 +1,24 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+#include <types.h>
+
+// the pageout thread wakes up when fewer than this percent of pages are free
+#define PAGEOUT_LOW_WATERMARK_PERCENT 5
+// and swaps pages out until this percent of pages are free again
+#define PAGEOUT_HIGH_WATERMARK_PERCENT 10
+
+/** Starts the pageout thread. The coremap and swapfile must already be
+ * initialized. **/
+void pageout_bootstrap();
+
+/** Tells the pageout thread how many pages are free so it can wake up if
+ * that is below the low watermark. Interrupts must be disabled. **/
+void pageout_notify(unsigned int free_pages);
+
+/** Tells the pageout thread that pages were freed, so that if its last
+ * pass couldn't free anything it tries again. Interrupts must be
+ * disabled. **/
+void pageout_pagefreed();
+
+#endif
@@ -16,6 +16,19 @@
 #define PAGE_W_MASK 			(0x00000004)
 #define PAGE_R_MASK 			(0x00000008)
 #define PAGE_X_MASK 			(0x00000010)
+#define PAGE_COW_MASK			(0x00000040)
+#define PAGE_PREFETCH_MASK		(0x00000080)
+#define PAGE_UNREFERENCED_MASK	(0x00000100)
+#define PAGE_DIRTY_MASK			(0x00000200)
+#define PAGE_BUSY_MASK			(0x00000400)
+
+// The UTLB refill code in exception.S walks the page table itself and
+// tests these bits by value, so it has to be kept in step with them.
+// Pages with PAGE_PREFETCH_MASK or PAGE_UNREFERENCED_MASK set are always
+// left for vm_fault. A writable page is only mapped writable in the TLB
+// once PAGE_DIRTY_MASK is set, so the first write to it faults.
+// PAGE_BUSY_MASK is only set on pages that aren't in memory, which the
+// refill code already leaves alone.
 
 #define SWP_PAGE				(0x1)
 #define SWP_TABLE				(0x2)
@@ -24,12 +37,41 @@
 
 struct pagetable {};
 
+// Sets up the zero page. Call once the coremap is initialized.
+void pt_bootstrap();
+
 struct pagetable *pt_create();
-void pt_destroy(struct pagetable *pt);
+void pt_destroy(struct addrspace *as);
 paddr_t pt_get_paddr(struct pagetable *pt, vaddr_t vaddr, int create, int permissions);
 int pt_set_permissions(struct pagetable *pt, vaddr_t vaddr, int create, int permissions);
-int pt_copy(struct pagetable *dst, struct addrspace *as);
+void pt_set_flags(struct pagetable *pt, vaddr_t vaddr, int flags);
+void pt_clear_flags(struct pagetable *pt, vaddr_t vaddr, int flags);
+int pt_copy(struct addrspace *dst, struct addrspace *as);
+paddr_t pt_copy_on_write(struct pagetable *pt, vaddr_t vaddr);
+int pt_map_page(struct pagetable *pt, vaddr_t vaddr, paddr_t paddr, int permissions);
+paddr_t pt_map_zero(struct pagetable *pt, vaddr_t vaddr, int permissions);
+
+// Frees the page of the address space at vaddr wherever it is, leaving the
+// address unused. Waits for the page first if it is busy.
+void pt_unmap_page(struct addrspace *as, vaddr_t vaddr);
+
+// A busy page is on its way into or out of memory. Whoever set the flag
+// does the I/O with interrupts enabled, and anyone else who wants the page
+// has to wait for it to finish. The page must not be in memory when it is
+// marked, and returns ENOMEM if its table couldn't be made.
+int pt_set_busy(struct pagetable *pt, vaddr_t vaddr);
+// Clears the flag, if it is still there, and wakes up whoever was waiting.
+void pt_clear_busy(struct pagetable *pt, vaddr_t vaddr);
+int pt_is_busy(struct pagetable *pt, vaddr_t vaddr);
+// Sleeps until some busy page is cleared. Interrupts must be disabled.
+void pt_wait_busy();
+
+// Points the page at vaddr at the frame it was moved to by compaction.
+void pt_notify_of_move(struct pagetable *pt, vaddr_t vaddr, paddr_t paddr);
 
 void pt_notify_of_swap(struct pagetable *pt, vaddr_t vaddr, int index);
+// Forgets a clean page so that the next fault loads it again from where it
+// came from (the executable or zeros) rather than from the swapfile.
+void pt_notify_of_discard(struct pagetable *pt, vaddr_t vaddr);
 
 #endif
@@ -10,25 +10,63 @@ struct addrspace;
 #define SWAPFILE_MAX_SIZE (9 * 1024 * 1024)
 #define SWAPFILE_MAX_PAGES (SWAPFILE_MAX_SIZE / PAGE_SIZE)
 
-// flag to turn off broken swapping code if we don't get it working in time
-#define SWAPPING_ENABLED 0
+// the most pages that are written out or read back in a single operation
+#define SWAPFILE_CLUSTER_PAGES 8
+
+// flag to turn off swapping. While it is off nothing is ever evicted: the
+// pageout thread isn't started and coremap_evictpages always returns 0
+#define SWAPPING_ENABLED 1
 
 void swapfile_bootstrap();
 void swapfile_shutdown();
 
+/** Swaps to a raw disk device such as lhd1raw: instead of SWAPFILE_NAME.
+ * Pages are read and written by sector with no filesystem in the way.
+ * This can only be done while nothing is swapped out, so it is meant to
+ * be given as a boot command. On failure the old swapfile is kept and
+ * an error code is returned. **/
+int swapfile_setdevice(const char *name);
+
 /** Stores a page starting at the source address and returns the index
  * of the swapfile entry or -1 if there was no room in the swapfile.
  * The source address must be page-aligned. **/
 int swapfile_storepage(void *source);
 
+/** Reserves a free page in the swapfile and returns its index or -1 if the
+ * swapfile is full. **/
 int swapfile_prepareswap();
 
+/** Reserves npages contiguous free pages in the swapfile and returns the
+ * index of the first or -1 if there is no such run. **/
+int swapfile_reserve(int npages);
+
+/** Frees npages swapfile pages starting at index, without reading them.
+ * A page that was shared is only freed once every holder has released it. **/
+void swapfile_release(int index, int npages);
+
+/** Adds another holder to a swapfile page in use, such as another page
+ * table that had the same page when it was swapped out. **/
+void swapfile_share(int index);
+
+/** Returns the number of free pages in the swapfile. **/
+unsigned int swapfile_getfreecount();
+
 void swapfile_performkswap(int index, void *source);
+
+/** Stores npages pages from the sources in the swapfile pages starting at
+ * index, which should come from swapfile_reserve, with a single write. **/
+void swapfile_performkswapcluster(int index, void **sources, int npages);
 void swapfile_performswap(int index, struct addrspace *addrspace, vaddr_t vaddr);
 
 /** Gets the given page from the swapfile and stores it in the destination
  * address. The entry from the swapfile is then cleared and reusable for
- * later swapping. **/
+ * later swapping. The pages after it are read in the same operation and
+ * kept in case they are asked for next. **/
 int swapfile_getpage(int index, void *dest);
 
+/** Same as swapfile_getpage but the entry stays in use, so the copy in the
+ * swapfile can stand in for the page if it is evicted again unchanged.
+ * The caller is responsible for releasing it. **/
+int swapfile_readpage(int index, void *dest);
+
 #endif
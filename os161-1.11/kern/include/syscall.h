@@ -25,5 +25,7 @@ pid_t sys_waitpid(pid_t pid, int *status, int options, int *errorcode);
 void sys__exit(int exitcode);
 int sys_execv(const char *program, char **args);
 
+void *sys_sbrk(int change, int *err);
+
 
 #endif /* _SYSCALL_H_ */
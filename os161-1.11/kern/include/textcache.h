@@ -0,0 +1,39 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <types.h>
+
+struct vnode;
+
+// the most executable text pages kept in the cache at once
+#define TEXTCACHE_MAX_PAGES 256
+// the number of hash chains the cached pages are spread across
+#define TEXTCACHE_BUCKETS 64
+
+void textcache_bootstrap();
+
+/** Looks for the text page of the executable at the given virtual address.
+ * On a hit the frame gets another coremap reference for the caller, who
+ * must coremap_freepages it when done, and its address is returned.
+ * Returns NULL on a miss. **/
+paddr_t textcache_get(struct vnode *vn, vaddr_t vaddr);
+
+/** Returns nonzero if the text page is in the cache, without taking it. **/
+int textcache_contains(struct vnode *vn, vaddr_t vaddr);
+
+/** Adds a freshly loaded text page to the cache, which keeps its own
+ * reference to the frame and to the vnode. Does nothing if the page is
+ * already cached or there is no room. **/
+void textcache_insert(struct vnode *vn, vaddr_t vaddr, paddr_t paddr);
+
+/** Drops the cached pages of a vnode, such as when the file is written. **/
+void textcache_invalidate(struct vnode *vn);
+
+/** Frees up to maxpages cached pages that no address space maps any more
+ * and returns how many were freed. **/
+int textcache_reclaim(int maxpages);
+
+/** Drops every page in the cache and the vnode references held for them. **/
+void textcache_flush();
+
+#endif
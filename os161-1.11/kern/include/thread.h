@@ -10,6 +10,12 @@
 
  #include "opt-A2.h"
 
+/*
+ * Most kernel stacks of dead threads kept for new ones, and how many are
+ * allocated ahead of time at boot.
+ */
+#define STACKCACHE_MAX     32
+#define STACKCACHE_PREWARM 16
 
 struct addrspace;
 
@@ -54,6 +60,9 @@ void thread_panic(void);
 /* Call during shutdown to clean up (must be called by initial thread) */
 void thread_shutdown(void);
 
+/* Call once the VM system is up to allocate the first cached stacks. */
+void thread_prewarmstacks(void);
+
 /*
  * Make a new thread, which will start executing at "func".  The
  * "data" arguments (one pointer, one integer) are passed to the
@@ -0,0 +1,44 @@
+#ifndef _TLBREPLACE_H_
+#define _TLBREPLACE_H_
+
+#include <types.h>
+
+// TLB replacement policies used to pick the slot a new entry goes in
+#define TLBREPLACE_INVALID 0	// an invalid slot if any, otherwise round-robin
+#define TLBREPLACE_RANDOM 1		// any slot at random
+#define TLBREPLACE_PLRU 2		// an invalid slot if any, otherwise second chance
+								// for slots holding pages that were refaulted
+#define TLBREPLACE_COUNT 3
+
+// the policy the kernel starts with
+#define TLBREPLACE_DEFAULT TLBREPLACE_PLRU
+
+// the number of recently replaced entries remembered to spot refaults
+#define TLBREPLACE_HISTORY 16
+
+// the lowest slots hold the kernel stacks of the running thread and of the
+// one being switched to and are never chosen, which the refill code in
+// exception.S also never writes to
+#define TLBREPLACE_WIRED 2
+
+/** Picks the slot the next TLB entry will be written to. Interrupts must
+ * be disabled for this and the notifications below. **/
+int tlbreplace_choose();
+
+/** Notes that the valid entry entryhi is being replaced. **/
+void tlbreplace_evicted(u_int32_t entryhi);
+
+/** Notes that entryhi was written to the slot. **/
+void tlbreplace_filled(int idx, u_int32_t entryhi);
+
+/** Notes that the slot was invalidated, or that all of them were. **/
+void tlbreplace_invalidated(int idx);
+void tlbreplace_flushed();
+
+/** Selects a policy by name, returning 0 on success or EINVAL. **/
+int tlbreplace_setpolicy(const char *name);
+
+/** Returns the name of the policy in use. **/
+const char *tlbreplace_getpolicy();
+
+#endif
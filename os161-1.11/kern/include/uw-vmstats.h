@@ -40,12 +40,46 @@
 #define VMSTAT_TLB_FAULT_REPLACE      (2)
 #define VMSTAT_TLB_INVALIDATE         (3)
 #define VMSTAT_TLB_RELOAD             (4)
-#define VMSTAT_PAGE_FAULT_ZERO        (5)
-#define VMSTAT_PAGE_FAULT_DISK        (6)
-#define VMSTAT_ELF_FILE_READ          (7)
-#define VMSTAT_SWAP_FILE_READ         (8)
-#define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_PAGE_FAULT_ZERO_READ   (5)
+#define VMSTAT_PAGE_FAULT_ZERO_WRITE  (6)
+#define VMSTAT_PAGE_FAULT_DISK        (7)
+#define VMSTAT_ELF_FILE_READ          (8)
+#define VMSTAT_SWAP_FILE_READ         (9)
+#define VMSTAT_SWAP_FILE_WRITE       (10)
+#define VMSTAT_PAGEOUT_WAKEUP        (11)
+#define VMSTAT_PAGEOUT_EVICT         (12)
+#define VMSTAT_PAGEOUT_LOW_WATERMARK (13)
+#define VMSTAT_PAGEOUT_HIGH_WATERMARK (14)
+#define VMSTAT_SWAP_DEVICE_WRITE     (15)
+#define VMSTAT_SWAP_DEVICE_READ      (16)
+#define VMSTAT_SWAP_READAHEAD_HIT    (17)
+#define VMSTAT_ELF_PREFETCH          (18)
+#define VMSTAT_ELF_PREFETCH_HIT      (19)
+#define VMSTAT_TEXTCACHE_HIT         (20)
+#define VMSTAT_TEXTCACHE_RECLAIM     (21)
+#define VMSTAT_ZEROPOOL_HIT          (22)
+#define VMSTAT_ZEROPOOL_MISS         (23)
+#define VMSTAT_ZEROPOOL_IDLE         (24)
+#define VMSTAT_TLB_FAST_RELOAD       (25)
+#define VMSTAT_TLB_REFAULT           (26)
+#define VMSTAT_PAGE_DIRTIED          (27)
+#define VMSTAT_PAGEOUT_DISCARD       (28)
+#define VMSTAT_SWAPCACHE_HIT         (29)
+#define VMSTAT_SWAPCACHE_DROP        (30)
+#define VMSTAT_ZSWAP_STORE           (31)
+#define VMSTAT_ZSWAP_SAME            (32)
+#define VMSTAT_ZSWAP_REJECT          (33)
+#define VMSTAT_ZSWAP_HIT             (34)
+#define VMSTAT_ZSWAP_MISS            (35)
+#define VMSTAT_ZSWAP_SPILL           (36)
+#define VMSTAT_ZSWAP_RATIO           (37)
+#define VMSTAT_PFF_GROW              (38)
+#define VMSTAT_PFF_SHRINK            (39)
+#define VMSTAT_COMPACT_SUCCESS       (40)
+#define VMSTAT_COMPACT_MIGRATE       (41)
+#define VMSTAT_PAGEOUT_MIN_FREE      (42)
+#define VMSTAT_ZERO_PAGE_COPY        (43)
+#define VMSTAT_COUNT                 (44)
 
 /* ----------------------------------------------------------------------- */
 
@@ -56,11 +90,19 @@ void _vmstats_init();                    /* atomicity must be ensured elsewhere
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
- *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+ *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO_READ);
  */
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Set the specified count to a value, for stats that are settings
+ * rather than counts of events.
+ * Example use:
+ *   vmstats_set(VMSTAT_PAGEOUT_LOW_WATERMARK, 12);
+ */
+void vmstats_set(unsigned int index, unsigned int value);    /* uses locking */
+void _vmstats_set(unsigned int index, unsigned int value);   /* atomicity must be ensured elsewhere */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print();                    /* uses locking */
 void _vmstats_print();                   /* atomicity must be ensured elsewhere */
@@ -13,6 +13,28 @@
  */
 
 
+/* Default and largest number of pages of a region loaded on one fault */
+#define VM_FAULTAROUND_DEFAULT 8
+#define VM_FAULTAROUND_MAX     16
+
+/* Most fault-around read buffers kept for reuse between faults */
+#define VM_FAULTAROUND_BUFFERS 4
+
+/*
+ * Page-fault-frequency control of the pages an address space may keep.
+ * The time between faults is counted in TLB misses of every process. An
+ * address space faulting again sooner than VM_PFF_HIGH is allowed more
+ * pages, and one going longer than VM_PFF_LOW is allowed fewer.
+ */
+#define VM_PFF_INITIAL 32    /* pages a new address space is allowed */
+#define VM_PFF_MIN     8     /* fewest pages an address space is allowed */
+#define VM_PFF_STEP    4     /* pages the allowance changes by at a time */
+#define VM_PFF_HIGH    64
+#define VM_PFF_LOW     1024
+
+/* Most pages the user stack may grow to below USERSTACK */
+#define VM_STACK_PAGES 1024
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -29,7 +51,41 @@ void vm_shutdown(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/* Set the number of pages of a region loaded on one fault */
+void vm_setfaultaround(int npages);
+
+/* Invalidate every entry in the TLB */
+void vm_tlb_flush(void);
+
+struct addrspace;
+
+/* Tag TLB entries with the address space's ASID, giving it one if needed */
+void vm_tlb_activate(struct addrspace *as);
+
+/* Stop the UTLB refill code using the address space's page table */
+void vm_tlb_deactivate(struct addrspace *as);
+
+/* Make every TLB entry of the address space read-only, keeping its ASID */
+void vm_tlb_writeprotect(struct addrspace *as);
+
+/* Drop the TLB entry of the address space for the page, if it has one */
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+/* Drop the TLB entry of a kernel page from vmalloc, if it has one */
+void vm_tlb_invalidatekernel(vaddr_t vaddr);
+
+/*
+ * Keep the kernel stack of the thread being switched to in the TLB while
+ * it runs. A TLB miss on the stack can't be handled since the exception
+ * code saves the trapframe there. Interrupts must be disabled.
+ */
+void vm_tlb_wirestack(vaddr_t stack);
+
+/*
+ * Allocate/free kernel heap pages (called by kmalloc/kfree). The pages are
+ * always contiguous in physical memory; large allocations that don't need
+ * that should use vmalloc.
+ */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
@@ -0,0 +1,30 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include <types.h>
+#include <vm.h>
+
+// the number of pages of kseg2 handed out by vmalloc, starting at its base
+#define VMALLOC_PAGES 1024
+#define VMALLOC_BASE MIPS_KSEG2
+#define VMALLOC_TOP (VMALLOC_BASE + VMALLOC_PAGES * PAGE_SIZE)
+
+/** Allocates size bytes of kernel memory in kseg2. The pages are backed by
+ * single frames from wherever the coremap has them, so unlike kmalloc a
+ * large allocation doesn't need physically contiguous memory. The memory
+ * is only reachable through the TLB, which vm_fault fills on a miss.
+ * Returns NULL if there is no memory or kseg2 space left. **/
+void *vmalloc(size_t size);
+
+/** Frees memory from vmalloc, dropping its TLB entries. **/
+void vfree(void *ptr);
+
+/** Returns the frame backing the kseg2 page at vaddr, or NULL if it isn't
+ * allocated. Never sleeps or locks, since it is used to fill the TLB on a
+ * miss, which can happen whatever the kernel is holding. **/
+paddr_t vmalloc_getpaddr(vaddr_t vaddr);
+
+/** Prints how much of the arena is in use. **/
+void vmalloc_printstats();
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+#include <types.h>
+
+// the most frames kept in the pool
+#define ZEROPOOL_PAGES 32
+
+// the pool only takes frames while more than this many are free
+#define ZEROPOOL_MIN_FREE 64
+
+/** Takes a zeroed frame from the pool, or returns NULL if there are none
+ * ready. The frame is allocated just as from coremap_getpages. **/
+paddr_t zeropool_getpage();
+
+/** Offers a single page frame that is being freed to the pool. Returns
+ * nonzero if the pool kept it, in which case it stays allocated and will
+ * be zeroed while the CPU is idle. Called by the coremap. **/
+int zeropool_putpage(paddr_t paddr);
+
+/** Zeroes one frame waiting in the pool, or takes a free frame and zeroes
+ * it if the pool isn't full and memory is plentiful. Called from the idle
+ * loop with interrupts off. Returns nonzero if a frame was zeroed. **/
+int zeropool_idle();
+
+/** Gives up to maxpages frames back to the coremap and returns how many
+ * were given back. **/
+int zeropool_reclaim(int maxpages);
+
+#endif
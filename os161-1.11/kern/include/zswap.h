@@ -0,0 +1,47 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <types.h>
+#include <vm.h>
+
+// flag to send every swapped page straight to the swapfile instead
+#define ZSWAP_ENABLED 1
+
+// the size of the pool compressed pages are kept in
+#define ZSWAP_POOL_PAGES 16
+
+// pages that don't compress to at least this size go straight to the
+// swapfile since they would hardly save anything
+#define ZSWAP_MAX_LENGTH (PAGE_SIZE / 2)
+
+/** Allocates the pool. Called when the swapfile is set up. **/
+void zswap_bootstrap();
+
+/** Compresses the page at source and keeps it for swapfile page index
+ * instead of writing it out. Returns 0 if it was kept, EINVAL if the page
+ * doesn't compress well enough to be worth keeping, or ENOSPC if the pool
+ * is too full, in which case zswap_spill makes room. The swapfile lock
+ * must be held for all of these. **/
+int zswap_store(int index, const void *source);
+
+/** Decompresses the oldest page in the pool to dest and forgets it, so
+ * that it can be written to the swapfile. Returns its swapfile index or -1
+ * if the pool is empty. **/
+int zswap_spill(void *dest);
+
+/** Decompresses the page kept for swapfile page index to dest. Returns
+ * nonzero if there was one. The page stays in the pool until its swapfile
+ * page is released. **/
+int zswap_load(int index, void *dest);
+
+/** Returns nonzero if a page is kept for swapfile page index. **/
+int zswap_contains(int index);
+
+/** Forgets the page kept for swapfile page index, if any. **/
+void zswap_invalidate(int index);
+
+/** Returns the average size of the pages stored so far as a percentage of
+ * their original size. **/
+unsigned int zswap_getratio();
+
+#endif
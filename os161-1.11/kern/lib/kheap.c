@@ -84,51 +84,65 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * The pagerefs are kept in pages of their own, chained together. The
+ * first is in the kernel BSS, so the heap works before anything can hand
+ * out pages, and more are allocated with alloc_kpages as the heap grows.
+ * Each page of pagerefs manages about 1M of heap, which used to be the
+ * limit. A page of pagerefs that falls out of use is given back, unless
+ * it is the first.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define NPAGEREFS ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define INUSE_WORDS ((NPAGEREFS + 31) / 32)
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static u_int32_t pagerefs_inuse[INUSE_WORDS];
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nused;
+	u_int32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
+
+static struct pagerefpage firstpagerefpage;
+static struct pagerefpage *pagerefpages = &firstpagerefpage;
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
+	struct pagerefpage *prp;
+	unsigned i;
 	u_int32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nused == NPAGEREFS) {
 			/* full */
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
+		break;
+	}
+
+	if (prp == NULL) {
+		/* all full; get another page of them */
+		prp = (struct pagerefpage *)alloc_kpages(1);
+		if (prp == NULL) {
+			return NULL;
+		}
+		bzero(prp->inuse, sizeof(prp->inuse));
+		prp->nused = 0;
+		prp->next = pagerefpages;
+		pagerefpages = prp;
+	}
+
+	for (i=0; i<NPAGEREFS; i++) {
+		k = ((u_int32_t)1) << (i%32);
+		if ((prp->inuse[i/32] & k)==0) {
+			prp->inuse[i/32] |= k;
+			prp->nused++;
+			return &prp->refs[i];
 		}
-		assert(0);
 	}
 
-	/* ran out */
+	panic("kmalloc: pageref page count and bitmap disagree\n");
 	return NULL;
 }
 
@@ -136,15 +150,29 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp, **link;
 	size_t i, j;
 	u_int32_t k;
 
-	j = p-pagerefs;
-	assert(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	for (link = &pagerefpages; *link != NULL; link = &(*link)->next) {
+		prp = *link;
+		if (p >= prp->refs && p < prp->refs + NPAGEREFS) {
+			break;
+		}
+	}
+	assert(*link != NULL);
+
+	j = p-prp->refs;
 	i = j/32;
 	k = ((u_int32_t)1) << (j%32);
-	assert((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	assert((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nused--;
+
+	if (prp->nused == 0 && prp != &firstpagerefpage) {
+		*link = prp->next;
+		free_kpages((vaddr_t)prp);
+	}
 }
 
 ////////////////////////////////////////
@@ -207,26 +235,32 @@ void
 checksubpages(void)
 {
 	struct pageref *pr;
+	struct pagerefpage *prp;
 	int i;
-	unsigned sc=0, ac=0;
+	unsigned sc=0, ac=0, nused=0;
 
 	assert(curspl>0);
 
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		nused += prp->nused;
+	}
+
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			assert(sc < NPAGEREFS);
+			assert(sc < nused);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		assert(ac < NPAGEREFS);
+		assert(ac < nused);
 		ac++;
 	}
 
 	assert(sc==ac);
+	assert(ac==nused);
 }
 #else
 #define checksubpages() 
@@ -289,11 +323,17 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct pagerefpage *prp;
+	unsigned npages = 0;
 
 	/* print the whole thing with interrupts off */
 	int spl = splhigh();
 
-	kprintf("Subpage allocator status:\n");
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		npages++;
+	}
+
+	kprintf("Subpage allocator status (%u pages of pagerefs):\n", npages);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
@@ -0,0 +1,92 @@
+/*
+ * Cache of constructed kernel objects. See objcache.h for details.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <objcache.h>
+#include <machine/spl.h>
+
+static struct objcache *allcaches;
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	void *obj;
+	int spl;
+
+	spl = splhigh();
+
+	if (!oc->oc_listed) {
+		oc->oc_next = allcaches;
+		allcaches = oc;
+		oc->oc_listed = 1;
+	}
+
+	oc->oc_allocs++;
+
+	if (oc->oc_nfree > 0) {
+		obj = oc->oc_free[--oc->oc_nfree];
+		oc->oc_hits++;
+		splx(spl);
+		return obj;
+	}
+
+	splx(spl);
+
+	obj = kmalloc(oc->oc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+
+	if (oc->oc_ctor != NULL && oc->oc_ctor(obj)) {
+		kfree(obj);
+		return NULL;
+	}
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	int spl;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	spl = splhigh();
+
+	if (oc->oc_nfree < OBJCACHE_DEPTH) {
+		oc->oc_free[oc->oc_nfree++] = obj;
+		splx(spl);
+		return;
+	}
+
+	splx(spl);
+
+	if (oc->oc_dtor != NULL) {
+		oc->oc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	int spl;
+
+	spl = splhigh();
+
+	kprintf("Object caches:\n");
+	kprintf("%-16s %6s %6s %10s %10s\n", "name", "size", "free", "allocs", "hits");
+	for (oc = allcaches; oc != NULL; oc = oc->oc_next) {
+		kprintf("%-16s %6lu %6u %10u %10u\n", oc->oc_name,
+			(unsigned long) oc->oc_size, oc->oc_nfree,
+			oc->oc_allocs, oc->oc_hits);
+	}
+
+	splx(spl);
+}
@@ -17,6 +17,7 @@
 #include <syscall.h>
 #include <version.h>
 #include <process.h>
+#include <textcache.h>
 
 #include "opt-A1.h"
 #include "opt-A3.h"
@@ -84,6 +85,7 @@ boot(void)
 	vfs_bootstrap();
 	dev_bootstrap();
 	vm_bootstrap();
+	thread_prewarmstacks();
 	kprintf_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -114,6 +116,10 @@ shutdown(void)
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
+#if OPT_A3
+	// the text cache holds on to vnodes that would keep filesystems busy
+	textcache_flush();
+#endif
 	vfs_unmountall();
 
 	splhigh();
@@ -14,11 +14,21 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <test.h>
+#include <objcache.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 
 #include "opt-A1.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <coremap.h>
+#include <swapfile.h>
+#include <tlbreplace.h>
+#include <vm.h>
+#include <vmalloc.h>
+#endif
 
 #define _PATH_SHELL "/bin/sh"
 
@@ -360,10 +370,110 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	objcache_printstats();
 	
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Command to swap to a raw disk instead of the emufs swapfile.
+ * Give it on the kernel command line, before anything gets swapped.
+ */
+static
+int
+cmd_swap(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: swap device:\n");
+		return EINVAL;
+	}
+
+	result = swapfile_setdevice(args[1]);
+	if (result) {
+		kprintf("swap: Could not swap to %s: %s\n", args[1],
+			strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+
+/*
+ * Command to set how many pages of a program are loaded on one fault.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: fa npages\n");
+		return EINVAL;
+	}
+
+	vm_setfaultaround(atoi(args[1]));
+
+	return 0;
+}
+
+/*
+ * Command to pick the policy used to choose TLB slots to replace.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: tlb invalid|random|plru\n");
+		kprintf("Current policy: %s\n", tlbreplace_getpolicy());
+		return EINVAL;
+	}
+
+	if (tlbreplace_setpolicy(args[1])) {
+		kprintf("tlb: No policy called %s\n", args[1]);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command to pick the policy used to choose pages to swap out.
+ */
+static
+int
+cmd_evictpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: evict random|clock\n");
+		kprintf("Current policy: %s\n", coremap_getpolicy());
+		return EINVAL;
+	}
+
+	if (coremap_setpolicy(args[1])) {
+		kprintf("evict: No policy called %s\n", args[1]);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+	vmalloc_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -404,6 +514,12 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[panic]   Intentional panic         ",
+#if OPT_A3
+	"[swap]    Set the swap device       ",
+	"[fa]      Set fault-around pages    ",
+	"[tlb]     Set TLB replacement policy",
+	"[evict]   Set page replacement policy",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -469,6 +585,9 @@ static const char *mainmenu[] = {
 	"[1b] Stoplight                      ",
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_A3
+	"[cm] Coremap free block stats       ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -510,6 +629,12 @@ static struct {
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
 	{ "panic",	cmd_panic },
+#if OPT_A3
+	{ "swap",	cmd_swap },
+	{ "fa",		cmd_faultaround },
+	{ "tlb",	cmd_tlbpolicy },
+	{ "evict",	cmd_evictpolicy },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -524,6 +649,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_A3
+	{ "cm",         cmd_coremapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -12,6 +12,11 @@
 #include <machine/spl.h>
 #include <queue.h>
 
+#include "opt-A3.h"
+#if OPT_A3
+#include <zeropool.h>
+#endif
+
 /*
  *  Scheduler data
  */
@@ -91,6 +96,14 @@ scheduler(void)
 	assert(curspl>0);
 	
 	while (q_empty(runqueue)) {
+#if OPT_A3
+		// Put the time to use zeroing pages for page faults, letting
+		// in any interrupts that came up after each one
+		if (zeropool_idle()) {
+			splx(spl0());
+			continue;
+		}
+#endif
 		cpu_idle();
 	}
 
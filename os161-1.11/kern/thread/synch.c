@@ -4,7 +4,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <objcache.h>
 #include <synch.h>
 #include <thread.h>
 #include <curthread.h>
@@ -99,19 +101,56 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_A1
+
+// The wait queue stays with a lock while it is in the cache, so making a
+// lock doesn't have to make a queue too. The same goes for CVs.
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->queue = q_create(LOCK_QUEUE_INITIAL_SIZE);
+	if (lock->queue == NULL) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	q_destroy((struct queue *) lock->queue);
+}
+
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", struct lock, lock_ctor, lock_dtor);
+
+#else
+
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", struct lock, NULL, NULL);
+
+#endif
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
 
-	lock = kmalloc(sizeof(struct lock));
+	lock = objcache_alloc(&lock_cache);
 	if (lock == NULL) {
 		return NULL;
 	}
 
 	lock->name = kstrdup(name);
 	if (lock->name == NULL) {
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL;
 	}
 
@@ -120,9 +159,6 @@ lock_create(const char *name)
 	// add stuff here as needed
 	lock->owner = NULL;
 
-	lock->queue = q_create(LOCK_QUEUE_INITIAL_SIZE);
-	assert(lock->queue != NULL);
-
 #endif
 
 	return lock;
@@ -148,7 +184,7 @@ lock_destroy(struct lock *lock)
 #endif
 	
 	kfree(lock->name);
-	kfree(lock);
+	objcache_free(&lock_cache, lock);
 }
 
 void
@@ -234,30 +270,56 @@ lock_do_i_hold(struct lock *lock)
 //
 // CV
 
+#if OPT_A1
+
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->queue = q_create(CV_QUEUE_INITIAL_SIZE);
+	if (cv->queue == NULL) {
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	q_destroy((struct queue *) cv->queue);
+}
+
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", struct cv, cv_ctor, cv_dtor);
+
+#else
+
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", struct cv, NULL, NULL);
+
+#endif
 
 struct cv *
 cv_create(const char *name)
 {
 	struct cv *cv;
 
-	cv = kmalloc(sizeof(struct cv));
+	cv = objcache_alloc(&cv_cache);
 	if (cv == NULL) {
 		return NULL;
 	}
 
 	cv->name = kstrdup(name);
 	if (cv->name==NULL) {
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
-	
-#if OPT_A1
-
-	// create the queue
-	cv->queue = q_create(CV_QUEUE_INITIAL_SIZE);
-	assert(cv->queue != NULL);
-
-#endif
 
 	return cv;
 }
@@ -274,15 +336,12 @@ cv_destroy(struct cv *cv)
 	// make sure there's nothing waiting on us
 	assert(q_empty((struct queue *) cv->queue));
 
-	// destroy the queue
-	q_destroy((struct queue *) cv->queue);
-
 	splx(spl);
 
 #endif
 
 	kfree(cv->name);
-	kfree(cv);
+	objcache_free(&cv_cache, cv);
 }
 
 void
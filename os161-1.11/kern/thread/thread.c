@@ -5,6 +5,7 @@
 #include <lib.h>
 #include <kern/errno.h>
 #include <array.h>
+#include <objcache.h>
 #include <machine/spl.h>
 #include <machine/pcb.h>
 #include <thread.h>
@@ -13,6 +14,12 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+
+#if OPT_A3
+#include <vm.h>
+#include <vmalloc.h>
+#endif
 
 /* States a thread can be in. */
 typedef enum {
@@ -34,6 +41,106 @@ static struct array *zombies;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/* Thread structures freed by exorcise, for thread_fork to reuse. */
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", struct thread, NULL, NULL);
+
+/*
+ * Kernel stacks of dead threads, for thread_fork to reuse without going
+ * to the page allocator. Each still has the magic number stamped on it
+ * when it was first allocated.
+ */
+static char *stackcache[STACKCACHE_MAX];
+static int stackcache_count;
+
+/*
+ * Allocate a kernel stack and stick a magic number on the bottom end of
+ * it, which is checked to catch stack overflows.
+ */
+static
+char *
+stack_create(void)
+{
+	char *stack;
+
+#if OPT_A3
+	stack = vmalloc(STACK_SIZE);
+#else
+	stack = kmalloc(STACK_SIZE);
+#endif
+	if (stack==NULL) {
+		return NULL;
+	}
+
+	stack[0] = 0xae;
+	stack[1] = 0x11;
+	stack[2] = 0xda;
+	stack[3] = 0x33;
+
+	return stack;
+}
+
+static
+void
+stack_destroy(char *stack)
+{
+#if OPT_A3
+	vfree(stack);
+#else
+	kfree(stack);
+#endif
+}
+
+/*
+ * Get a kernel stack, from the cache if it has one.
+ */
+static
+char *
+stack_get(void)
+{
+	char *stack = NULL;
+	int s;
+
+	s = splhigh();
+	if (stackcache_count > 0) {
+		stack = stackcache[--stackcache_count];
+	}
+	splx(s);
+
+	if (stack==NULL) {
+		stack = stack_create();
+	}
+	return stack;
+}
+
+/*
+ * Give back a kernel stack that is no longer being run on, keeping it if
+ * the cache has room.
+ */
+static
+void
+stack_put(char *stack)
+{
+	int s;
+
+	/* the magic number has to have survived for the stack to be reused */
+	assert(stack[0] == (char)0xae);
+	assert(stack[1] == (char)0x11);
+	assert(stack[2] == (char)0xda);
+	assert(stack[3] == (char)0x33);
+
+	s = splhigh();
+	if (stackcache_count < STACKCACHE_MAX) {
+		stackcache[stackcache_count++] = stack;
+		stack = NULL;
+	}
+	splx(s);
+
+	if (stack != NULL) {
+		stack_destroy(stack);
+	}
+}
+
 /*
  * Create a thread. This is used both to create the first thread's 
  * thread structure and to create subsequent threads.
@@ -43,13 +150,13 @@ static
 struct thread *
 thread_create(const char *name)
 {
-	struct thread *thread = kmalloc(sizeof(struct thread));
+	struct thread *thread = objcache_alloc(&thread_cache);
 	if (thread==NULL) {
 		return NULL;
 	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name==NULL) {
-		kfree(thread);
+		objcache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
@@ -85,11 +192,11 @@ thread_destroy(struct thread *thread)
 	assert(thread->t_cwd==NULL);
 	
 	if (thread->t_stack) {
-		kfree(thread->t_stack);
+		stack_put(thread->t_stack);
 	}
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(&thread_cache, thread);
 }
 
 
@@ -259,6 +366,24 @@ thread_shutdown(void)
 	//thread_destroy(curthread);
 }
 
+/*
+ * Fill the stack cache so that the first threads forked don't have to
+ * allocate stacks either.
+ */
+void
+thread_prewarmstacks(void)
+{
+	char *stack;
+
+	while (stackcache_count < STACKCACHE_PREWARM) {
+		stack = stack_create();
+		if (stack==NULL) {
+			break;
+		}
+		stack_put(stack);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  * The new thread has name NAME, and starts executing in function FUNC.
@@ -279,20 +404,14 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newguy->t_stack = kmalloc(STACK_SIZE);
+	/* Get a stack, which already has its magic number */
+	newguy->t_stack = stack_get();
 	if (newguy->t_stack==NULL) {
 		kfree(newguy->t_name);
-		kfree(newguy);
+		objcache_free(&thread_cache, newguy);
 		return ENOMEM;
 	}
 
-	/* stick a magic number on the bottom end of the stack */
-	newguy->t_stack[0] = 0xae;
-	newguy->t_stack[1] = 0x11;
-	newguy->t_stack[2] = 0xda;
-	newguy->t_stack[3] = 0x33;
-
 #if OPT_A2
 	newguy->t_pid = curthread->t_pid;
 #endif
@@ -362,9 +481,9 @@ thread_fork(const char *name,
 	if (newguy->t_cwd != NULL) {
 		VOP_DECREF(newguy->t_cwd);
 	}
-	kfree(newguy->t_stack);
+	stack_put(newguy->t_stack);
 	kfree(newguy->t_name);
-	kfree(newguy);
+	objcache_free(&thread_cache, newguy);
 
 	return result;
 }
@@ -436,6 +555,11 @@ mi_switch(threadstate_t nextstate)
 
 	/* update curthread */
 	curthread = next;
+
+#if OPT_A3
+	/* the new stack has to be mapped before it is switched to */
+	vm_tlb_wirestack((vaddr_t)next->t_stack);
+#endif
 	
 	/* 
 	 * Call the machine-dependent code that actually does the
@@ -21,6 +21,8 @@
 
 #define DUMBVM_STACKPAGES    12
 
+static int as_searchregions(struct addrspace *as, vaddr_t vaddr);
+
 struct addrspace *
 as_create(void)
 {
@@ -29,7 +31,19 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_regions = NULL;
 	as->as_region_count = 0;
+	as->as_region_max = 0;
+	as->as_heapbase = 0;
+
+	// an ID is handed out the first time the address space is activated
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+
+	as->as_resident = 0;
+	as->as_allowance = VM_PFF_INITIAL;
+	as->as_lastfault = 0;
+	as->as_busy = 0;
 
 	as->as_pt = pt_create();
 	if (as->as_pt == NULL) {
@@ -44,27 +58,49 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	int result;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	if (pt_copy(new->as_pt, old)) {
+	old->as_busy += 1;
+	new->as_busy += 1;
+	result = pt_copy(new, old);
+	new->as_busy -= 1;
+	old->as_busy -= 1;
+
+	if (result) {
 		as_destroy(new);
+		vm_tlb_writeprotect(old);
 		return ENOMEM;
 	}
 
+	// The old address space's writable pages are copy-on-write now,
+	// so it can't keep any writable TLB entries for them
+	vm_tlb_writeprotect(old);
+
+	if (old->as_region_count > 0) {
+		new->as_regions = kmalloc(sizeof(struct region) * old->as_region_count);
+		if (new->as_regions == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memmove(new->as_regions, old->as_regions,
+			sizeof(struct region) * old->as_region_count);
+	}
+
+	// as_destroy doesn't close the executable, so only take the
+	// references once nothing can fail
 	VOP_INCOPEN(old->as_v);
 	VOP_INCREF(old->as_v);
 
 	new->as_v = old->as_v;
 
-	// TODO - copy
 	new->as_region_count = old->as_region_count;
-	memmove((void *)&new->as_regions,
-		(const void *)(paddr_t)&old->as_regions,
-		(sizeof(struct region) * new->as_region_count));
+	new->as_region_max = old->as_region_count;
+	new->as_heapbase = old->as_heapbase;
 	
 	*ret = new;
 	return 0;
@@ -76,30 +112,22 @@ as_destroy(struct addrspace *as)
 	assert(as != NULL);
 	assert(as->as_pt != NULL);
 
-	pt_destroy(as->as_pt);
+	// it is never done with its pages after this
+	as->as_busy += 1;
+
+	vm_tlb_deactivate(as);
+	pt_destroy(as);
 	
+	kfree(as->as_regions);
 	kfree(as);
 }
 
 void
 as_activate(struct addrspace *as)
 {
-	// TODO
-
-	int i, spl;
-
-	(void)as;
-
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	// TLB has been entirely invalidated
-	vmstats_inc(VMSTAT_TLB_INVALIDATE);
-
-	splx(spl);
+	// The TLB entries of other address spaces are told apart by their
+	// ASID so they can stay put
+	vm_tlb_activate(as);
 }
 
 /*
@@ -119,10 +147,8 @@ as_define_region(struct addrspace *as, off_t offset,
 {
 	// memsize was what was originally passed in
 
-	struct pagetable *pt = as->as_pt;
 	int permissions = 0;
-	int error;
-	int nregions;
+	int i, nregions;
 	struct region *region;
 
 	if (readable) { permissions |= PAGE_R_MASK; }
@@ -132,11 +158,35 @@ as_define_region(struct addrspace *as, off_t offset,
 
 	nregions = as->as_region_count;
 
-	if (nregions == MAX_REGIONS) {
-		panic("vm: too many regions defined. OH GOD, EVERYBODY PANIC.");
+	// the region goes after the last one starting before it, as long as
+	// it doesn't overlap either of its neighbours
+	i = as_searchregions(as, vaddr);
+	if (i >= 0 && vaddr < as->as_regions[i].vaddr + as->as_regions[i].memsize) {
+		return EINVAL;
+	}
+	if (i + 1 < nregions && vaddr + memsize > as->as_regions[i + 1].vaddr) {
+		return EINVAL;
 	}
 
-	region = &as->as_regions[nregions];
+	if (nregions == as->as_region_max) {
+		int max = (nregions == 0 ? AS_REGIONS_INITIAL : nregions * 2);
+		struct region *regions = kmalloc(sizeof(struct region) * max);
+		if (regions == NULL) {
+			return ENOMEM;
+		}
+
+		if (nregions > 0) {
+			memmove(regions, as->as_regions, sizeof(struct region) * nregions);
+		}
+		kfree(as->as_regions);
+
+		as->as_regions = regions;
+		as->as_region_max = max;
+	}
+
+	region = &as->as_regions[i + 1];
+	memmove(region + 1, region, sizeof(struct region) * (nregions - (i + 1)));
+
 	region->offset = offset;
 	region->memsize = memsize;
 	region->filesize = filesize;
@@ -148,32 +198,152 @@ as_define_region(struct addrspace *as, off_t offset,
 	return 0;
 }
 
+/*
+ * Returns the index of the last region starting at or below vaddr, or -1
+ * if they all start above it.
+ */
+static int
+as_searchregions(struct addrspace *as, vaddr_t vaddr)
+{
+	int low = 0, high = as->as_region_count - 1, found = -1;
+
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		if (as->as_regions[middle].vaddr <= vaddr) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return found;
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region;
+	int i = as_searchregions(as, vaddr);
+
+	// the region vaddr is in, or the end of one in the same page
+	if (i >= 0) {
+		region = &as->as_regions[i];
+		if (vaddr < ((region->vaddr + region->memsize + PAGE_SIZE - 1) & PAGE_FRAME)) {
+			return region;
+		}
+	}
+
+	// or the start of one in the same page
+	if (i + 1 < as->as_region_count) {
+		region = &as->as_regions[i + 1];
+		if ((vaddr & PAGE_FRAME) == (region->vaddr & PAGE_FRAME)) {
+			return region;
+		}
+	}
+
+	return NULL;
+}
+
+int
+as_isstack(vaddr_t vaddr)
+{
+	return vaddr < USERSTACK && vaddr >= USERSTACK - VM_STACK_PAGES * PAGE_SIZE;
+}
+
+/*
+ * Sets up an empty heap region starting at the first page past the other
+ * regions, for sbrk to grow.
+ */
+static
+int
+as_define_heap(struct addrspace *as)
+{
+	vaddr_t base = 0;
+	struct region *last;
+
+	if (as->as_region_count > 0) {
+		last = &as->as_regions[as->as_region_count - 1];
+		base = (last->vaddr + last->memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+	}
+
+	int result = as_define_region(as, 0, 0, 0, base, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	as->as_heapbase = base;
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, int change, vaddr_t *oldbreak)
+{
+	struct region *heap;
+	vaddr_t top, newtop, limit, addr;
+	int i, spl;
+
+	if (as == NULL || as->as_heapbase == 0) {
+		return EINVAL;
+	}
+
+	spl = splhigh();
+
+	i = as_searchregions(as, as->as_heapbase);
+	assert(i >= 0 && as->as_regions[i].vaddr == as->as_heapbase);
+	heap = &as->as_regions[i];
+
+	top = heap->vaddr + heap->memsize;
+	*oldbreak = top;
+
+	// the heap can grow up to the next region or the stack
+	limit = USERSTACK - VM_STACK_PAGES * PAGE_SIZE;
+	if (i + 1 < as->as_region_count && (as->as_regions[i + 1].vaddr & PAGE_FRAME) < limit) {
+		limit = as->as_regions[i + 1].vaddr & PAGE_FRAME;
+	}
+
+	if (change < 0) {
+		if ((size_t) -change > heap->memsize) {
+			splx(spl);
+			return EINVAL;
+		}
+	} else if ((vaddr_t) change > limit - top) {
+		splx(spl);
+		return ENOMEM;
+	}
+
+	newtop = top + change;
+	heap->memsize += change;
+
+	// give back the pages the heap doesn't reach any more
+	as->as_busy += 1;
+	for (addr = (newtop + PAGE_SIZE - 1) & PAGE_FRAME; addr < top; addr += PAGE_SIZE) {
+		pt_unmap_page(as, addr);
+		vm_tlb_invalidate(as, addr);
+	}
+	as->as_busy -= 1;
+
+	splx(spl);
+
+	return 0;
+}
+
 
 paddr_t as_get_paddr(struct addrspace *as, vaddr_t vaddr) {
-	// TODO - traverse regions
-	int i, nregions;
 	struct region *region;
 	struct pagetable *pt = as->as_pt;
-	vaddr_t rbot, rtop;
 	paddr_t paddr;
 
 	paddr = pt_get_paddr(pt, vaddr, 0, 0);
 
 	if (paddr & PAGE_FREE) {
-		nregions = as->as_region_count;
-
-		for (i = 0; i < nregions; i++) {
-			region = &as->as_regions[i];
-			rbot = region->vaddr;
-			rtop = rbot + region->memsize;
-			if (vaddr < rtop && vaddr >= rbot) {
-				paddr = pt_get_paddr(pt, vaddr, 1, PAGE_R_MASK | PAGE_W_MASK);
-				// TODO - load tlb shit so we dont endlessly vm_fault
-				// load_region(as->as_v, region, )
-
-				pt_set_permissions(pt, vaddr, 1, region->permissions);
-			}
-			break;
+		region = as_findregion(as, vaddr);
+		if (region != NULL) {
+			paddr = pt_get_paddr(pt, vaddr, 1, PAGE_R_MASK | PAGE_W_MASK);
+			// TODO - load tlb shit so we dont endlessly vm_fault
+			// load_region(as->as_v, region, )
+
+			pt_set_permissions(pt, vaddr, 1, region->permissions);
 		}
 	}
 
@@ -210,9 +380,12 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	// TODO
-
-	(void)as;
+	// the stack itself is whatever of the top VM_STACK_PAGES gets used,
+	// but the heap goes past the regions loaded from the executable
+	int result = as_define_heap(as);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -222,11 +395,9 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 
 int as_valid_ptr(vaddr_t ptr) {
 	// TODO
-	vaddr_t rbot, rtop;
 	paddr_t paddr;
 	struct addrspace *as;
-	struct region *region;
-	int spl, i;
+	int spl;
 
 	spl = splhigh();
 
@@ -237,16 +408,9 @@ int as_valid_ptr(vaddr_t ptr) {
 		return EFAULT;
 	}
 
-	// TODO - check regions
-
-	for (i = 0; i < as->as_region_count; i++) {
-		region = &as->as_regions[i];
-		rbot = region->vaddr;
-		rtop = rbot + region->memsize;
-		if (ptr < rtop && ptr >= rbot) {
-			splx(spl);
-			return 0;
-		}
+	if (as_findregion(as, ptr) != NULL) {
+		splx(spl);
+		return 0;
 	}
 
 	paddr = pt_get_paddr(as->as_pt, ptr & PAGE_FRAME, 0, 0);
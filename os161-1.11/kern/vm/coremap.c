@@ -1,15 +1,41 @@
 #include <coremap.h>
 
 #include <addrspace.h>
-#include <curthread.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <pageout.h>
 #include <swapfile.h>
 #include <synch.h>
+#include <textcache.h>
 #include <thread.h>
+#include <uw-vmstats.h>
 #include <vm.h>
+#include <zeropool.h>
+#include <machine/spl.h>
 
 struct coremap_page *coremap;
 
+// the reverse mappings of shared pages, in pages taken from the coremap as
+// they are needed and never given back
+#define RMAP_PER_PAGE (PAGE_SIZE / sizeof (struct coremap_rmap))
+#define RMAP(entry) (&rmap_pages[(entry) / RMAP_PER_PAGE][(entry) % RMAP_PER_PAGE])
+static struct coremap_rmap *rmap_pages[COREMAP_RMAP_MAXPAGES];
+static unsigned int rmap_npages = 0;
+// the number of reverse mappings in use
+static unsigned int rmap_in_use = 0;
+// the first unused reverse mapping or -1
+static int rmap_free = -1;
+
+// what walking the mappings of a page gives for the one kept in its entry
+#define RMAP_INLINE (-2)
+
+// accessors for the fields packed into the flags of a coremap entry
+#define CM_GET(page, field) \
+	((coremap[page].flags & COREMAP_##field##_MASK) >> COREMAP_##field##_SHIFT)
+#define CM_SET(page, field, value) \
+	(coremap[page].flags = (coremap[page].flags & ~COREMAP_##field##_MASK) | \
+		(((u_int32_t) (value) << COREMAP_##field##_SHIFT) & COREMAP_##field##_MASK))
+
 // a lock used while accessing the coremap
 static struct lock *coremap_lock;
 
@@ -20,7 +46,22 @@ static unsigned int coremap_size;
 // the number of non-free entries in the coremap (for debugging purposes)
 static unsigned int coremap_pages_in_use = 0;
 
-static unsigned int last_page_used = 0;
+// the first free block of each order or -1 if there are none
+static int free_lists[COREMAP_ORDERS];
+// the number of free blocks of each order (for debugging purposes)
+static unsigned int free_blocks[COREMAP_ORDERS];
+
+#if SWAPPING_ENABLED
+// the page replacement policy in use
+static int coremap_policy = COREMAP_EVICTION_POLICY;
+
+// the next page the clock hand will look at
+static unsigned int clock_hand = 0;
+#endif
+
+static void coremap_freerange(unsigned int page, unsigned long npages);
+static int coremap_getfreepages(unsigned long npages);
+static void coremap_clearused(unsigned int page);
 
 void coremap_bootstrap() {
 	// get the size of the memory
@@ -34,28 +75,34 @@ void coremap_bootstrap() {
 	coremap = (struct coremap_page *) PADDR_TO_KVADDR(first);
 	first += coremap_size * sizeof (struct coremap_page);
 
+	// the last page of the coremap itself isn't free either
+	first = (first + PAGE_SIZE - 1) & PAGE_FRAME;
+
 	// initialize the coremap
 	unsigned int i;
+	for (i = 0; i < COREMAP_ORDERS; i++) {
+		free_lists[i] = -1;
+		free_blocks[i] = 0;
+	}
+
 	for (i = 0; i < first / PAGE_SIZE; i++) {
-		coremap[i].addr = (vaddr_t) NULL;
-		coremap[i].addrspace = (struct addrspace *) NULL;
-		coremap[i].page_count = 0;
-		coremap[i].state = FIXED;
+		coremap[i].flags = 0;
+		CM_SET(i, STATE, FIXED);
+		CM_SET(i, REFCOUNT, 1);
+		coremap_clearused(i);
 
 		coremap_pages_in_use += 1;
 	}
-	for (i = first / PAGE_SIZE; i < coremap_size; i++) {
-		coremap[i].addr = (vaddr_t) NULL;
-		coremap[i].addrspace = (struct addrspace *) NULL;
-		coremap[i].page_count = 0;
-		coremap[i].state = FREE;
-	}
+
+	// hand the rest of memory to the buddy allocator
+	coremap_freerange(first / PAGE_SIZE, coremap_size - first / PAGE_SIZE);
 
 	// create a lock for the coremap
 	coremap_lock = lock_create("coremap_lock");
 	if (coremap_lock == NULL) panic("Unable to instantiate coremap_lock.\n");
 
-	DEBUG(DB_COREMAP, "%u of %u pages in use after coremap initialization.\n", coremap_pages_in_use, coremap_size);
+	DEBUG(DB_COREMAP, "%u of %u pages in use after coremap initialization (%u bytes of entries).\n",
+			coremap_pages_in_use, coremap_size, coremap_size * sizeof (struct coremap_page));
 
 	coremap_initialized = 1;
 }
@@ -64,37 +111,581 @@ void coremap_shutdown() {
 	lock_destroy(coremap_lock);
 }
 
-/** Utility method to get a free page in the swapfile. **/
+/** Returns the order of the free block starting at page or -1 if page
+ * doesn't start a free block. **/
+static int coremap_getorder(unsigned int page) {
+	if (CM_GET(page, STATE) != FREE) {
+		return -1;
+	}
+	return (int) CM_GET(page, SIZE) - 1;
+}
+
+/** Utility methods to keep the free lists of the buddy allocator. **/
+static void coremap_listadd(int page, int order) {
+	CM_SET(page, SIZE, order + 1);
+	coremap[page].u.free.prev = -1;
+	coremap[page].u.free.next = free_lists[order];
+
+	if (free_lists[order] != -1) {
+		coremap[free_lists[order]].u.free.prev = page;
+	}
+	free_lists[order] = page;
+
+	free_blocks[order] += 1;
+}
+
+static void coremap_listremove(int page) {
+	int order = coremap_getorder(page);
+	assert(order >= 0 && order < COREMAP_ORDERS);
+
+	int next = coremap[page].u.free.next;
+	int prev = coremap[page].u.free.prev;
+
+	if (prev != -1) {
+		coremap[prev].u.free.next = next;
+	} else {
+		free_lists[order] = next;
+	}
+	if (next != -1) {
+		coremap[next].u.free.prev = prev;
+	}
+
+	CM_SET(page, SIZE, 0);
+
+	free_blocks[order] -= 1;
+}
+
+/** Puts a free block back in the free lists, merging it with its buddy
+ * for as long as the buddy is free as well. **/
+static void coremap_freeblock(unsigned int page, int order) {
+	while (order < COREMAP_ORDERS - 1) {
+		unsigned int buddy = page ^ (1 << order);
+
+		if (buddy + (1 << order) > coremap_size || coremap_getorder(buddy) != order) {
+			break;
+		}
+
+		coremap_listremove(buddy);
+
+		if (buddy < page) {
+			page = buddy;
+		}
+		order += 1;
+	}
+
+	coremap_listadd(page, order);
+}
+
+/** Utility methods to walk the mappings of a page:
+ *     for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i))
+ * gives each one in turn to coremap_mapas and coremap_mapaddr. **/
+static int coremap_mapfirst(const struct coremap_mappings *m) {
+	return (m->addrspace != NULL ? RMAP_INLINE : m->to.rmap);
+}
+
+static int coremap_mapnext(int i) {
+	return (i == RMAP_INLINE ? -1 : RMAP(i)->next);
+}
+
+static struct addrspace *coremap_mapas(const struct coremap_mappings *m, int i) {
+	return (i == RMAP_INLINE ? m->addrspace : RMAP(i)->addrspace);
+}
+
+static vaddr_t coremap_mapaddr(const struct coremap_mappings *m, int i) {
+	return (i == RMAP_INLINE ? m->to.addr : RMAP(i)->addr);
+}
+
+/** Takes an unused reverse mapping, adding another page of them when they
+ * are all in use. Returns -1 if there's no memory for more. **/
+static int coremap_rmapalloc() {
+	unsigned int i;
+
+	if (rmap_free == -1) {
+		if (rmap_npages == COREMAP_RMAP_MAXPAGES) {
+			return -1;
+		}
+
+		int page = coremap_getfreepages(1);
+		if (page == -1) {
+			return -1;
+		}
+
+		// the page belongs to the coremap from now on
+		CM_SET(page, STATE, FIXED);
+		CM_SET(page, SIZE, 1);
+		CM_SET(page, REFCOUNT, 1);
+		coremap_pages_in_use += 1;
+
+		struct coremap_rmap *entries = (struct coremap_rmap *) PADDR_TO_KVADDR((paddr_t) page * PAGE_SIZE);
+		int base = rmap_npages * RMAP_PER_PAGE;
+		for (i = 0; i < RMAP_PER_PAGE; i++) {
+			entries[i].next = (i + 1 < RMAP_PER_PAGE ? base + (int) i + 1 : -1);
+		}
+		rmap_pages[rmap_npages++] = entries;
+		rmap_free = base;
+
+		DEBUG(DB_COREMAP, "Added page %d of reverse mappings.\n", page);
+	}
+
+	int entry = rmap_free;
+	rmap_free = RMAP(entry)->next;
+	rmap_in_use += 1;
+
+	return entry;
+}
+
+static void coremap_rmaprelease(int entry) {
+	RMAP(entry)->next = rmap_free;
+	rmap_free = entry;
+	rmap_in_use -= 1;
+}
+
+/** Utility methods to keep the mappings of a page. Each address space's
+ * resident page count includes the user pages (not page tables) it maps. **/
+static int coremap_rmapadd(unsigned int page, struct addrspace *addrspace, vaddr_t vaddr) {
+	struct coremap_mappings *m = &coremap[page].u.used;
+
+	if (m->addrspace == NULL && m->to.rmap == -1) {
+		m->addrspace = addrspace;
+		m->to.addr = vaddr;
+	} else {
+		// a second mapping moves the first one into a chain as well
+		if (m->addrspace != NULL) {
+			int first = coremap_rmapalloc();
+			if (first == -1) {
+				DEBUG(DB_COREMAP, "Out of reverse mappings for page %u.\n", page);
+				return 0;
+			}
+
+			RMAP(first)->addrspace = m->addrspace;
+			RMAP(first)->addr = m->to.addr;
+			RMAP(first)->next = -1;
+			m->addrspace = NULL;
+			m->to.rmap = first;
+		}
+
+		int entry = coremap_rmapalloc();
+		if (entry == -1) {
+			DEBUG(DB_COREMAP, "Out of reverse mappings for page %u.\n", page);
+			return 0;
+		}
+
+		RMAP(entry)->addrspace = addrspace;
+		RMAP(entry)->addr = vaddr;
+		RMAP(entry)->next = m->to.rmap;
+		m->to.rmap = entry;
+	}
+
+	if (vaddr & SWP_PAGE) {
+		addrspace->as_resident += 1;
+	}
+
+	return 1;
+}
+
+static void coremap_rmapremove(unsigned int page, struct addrspace *addrspace) {
+	struct coremap_mappings *m = &coremap[page].u.used;
+	vaddr_t addr;
+
+	if (m->addrspace != NULL) {
+		if (m->addrspace != addrspace) {
+			return;
+		}
+
+		addr = m->to.addr;
+		m->addrspace = NULL;
+		m->to.rmap = -1;
+	} else {
+		int *link = &m->to.rmap;
+		while (*link != -1 && RMAP(*link)->addrspace != addrspace) {
+			link = &RMAP(*link)->next;
+		}
+		if (*link == -1) {
+			return;
+		}
+
+		int entry = *link;
+		*link = RMAP(entry)->next;
+		addr = RMAP(entry)->addr;
+		coremap_rmaprelease(entry);
+
+		// a page left with one mapping keeps it in its entry again
+		int head = m->to.rmap;
+		if (head != -1 && RMAP(head)->next == -1) {
+			m->addrspace = RMAP(head)->addrspace;
+			m->to.addr = RMAP(head)->addr;
+			coremap_rmaprelease(head);
+		}
+	}
+
+	if (addr & SWP_PAGE) {
+		addrspace->as_resident -= 1;
+	}
+}
+
+/** Takes all the mappings off a page and returns them. They are left alone
+ * until coremap_rmapattach or coremap_rmapfree. **/
+static struct coremap_mappings coremap_rmapdetach(unsigned int page) {
+	struct coremap_mappings mappings = coremap[page].u.used;
+	int i;
+
+	for (i = coremap_mapfirst(&mappings); i != -1; i = coremap_mapnext(i)) {
+		if (coremap_mapaddr(&mappings, i) & SWP_PAGE) {
+			coremap_mapas(&mappings, i)->as_resident -= 1;
+		}
+	}
+	coremap[page].u.used.addrspace = NULL;
+	coremap[page].u.used.to.rmap = -1;
+
+	return mappings;
+}
+
+static void coremap_rmapattach(unsigned int page, const struct coremap_mappings *mappings) {
+	int i;
+
+	assert(coremap_mapfirst(&coremap[page].u.used) == -1);
+
+	for (i = coremap_mapfirst(mappings); i != -1; i = coremap_mapnext(i)) {
+		if (coremap_mapaddr(mappings, i) & SWP_PAGE) {
+			coremap_mapas(mappings, i)->as_resident += 1;
+		}
+	}
+	coremap[page].u.used = *mappings;
+}
+
+static void coremap_rmapfree(const struct coremap_mappings *mappings) {
+	int entry = (mappings->addrspace != NULL ? -1 : mappings->to.rmap);
+
+	while (entry != -1) {
+		int next = RMAP(entry)->next;
+		coremap_rmaprelease(entry);
+		entry = next;
+	}
+}
+
+static unsigned int coremap_rmapcount(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+	unsigned int count = 0;
+	int i;
+
+	for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i)) {
+		count++;
+	}
+
+	return count;
+}
+
+/** Marks an allocated page as mapped by nothing and with no swapfile
+ * copy. **/
+static void coremap_clearused(unsigned int page) {
+	coremap[page].u.used.addrspace = NULL;
+	coremap[page].u.used.to.rmap = -1;
+	coremap[page].swapslot = -1;
+}
+
+/** Frees a run of pages that doesn't have to be a power of two long by
+ * splitting it into the largest aligned blocks it contains. Their reverse
+ * mappings must already be gone. **/
+static void coremap_freerange(unsigned int page, unsigned long npages) {
+	unsigned int i;
+	for (i = page; i < page + npages; i++) {
+		coremap[i].flags = 0;
+		CM_SET(i, STATE, FREE);
+	}
+
+	while (npages > 0) {
+		int order = 0;
+		while (order < COREMAP_ORDERS - 1 && (page & (1 << order)) == 0 &&
+				(1UL << (order + 1)) <= npages) {
+			order += 1;
+		}
+
+		coremap_freeblock(page, order);
+
+		page += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/** Marks the first npages pages of a block of the given order, which is
+ * already off the free lists, as allocated and gives back the rest. **/
+static void coremap_takeblock(unsigned int page, int order, unsigned long npages) {
+	unsigned int i;
+	for (i = page; i < page + npages; i++) {
+		coremap[i].flags = 0;
+		CM_SET(i, STATE, ALLOCATED);
+		CM_SET(i, REFERENCED, 1);
+		coremap_clearused(i);
+	}
+
+	// give back the pages we rounded up to get
+	if (npages < (1UL << order)) {
+		coremap_freerange(page + npages, (1UL << order) - npages);
+	}
+}
+
+/** Utility method to get npages free pages in the coremap. The smallest
+ * block that fits is split in half until it is just big enough, and any
+ * pages past npages are given back. **/
 static int coremap_getfreepages(unsigned long npages) {
-	unsigned int i, pages = 0;
-	for (i = last_page_used; i < coremap_size; i++) {
-		if (coremap[i].state == FREE) {
-			pages += 1;
-		} else {
-			pages = 0;
+	int order = 0, k;
+	while ((1UL << order) < npages) {
+		order += 1;
+	}
+
+	if (order >= COREMAP_ORDERS) {
+		return -1;
+	}
+
+	for (k = order; k < COREMAP_ORDERS && free_lists[k] == -1; k++);
+
+	if (k == COREMAP_ORDERS) {
+		return -1;
+	}
+
+	int page = free_lists[k];
+	coremap_listremove(page);
+
+	// split off the upper halves until the block is the right order
+	while (k > order) {
+		k -= 1;
+		coremap_listadd(page + (1 << k), k);
+	}
+
+	coremap_takeblock(page, order, npages);
+
+	return page;
+}
+
+/** Returns nonzero if compaction can move the page to another frame, which
+ * is if it is a user page that every reference to is a mapping we know
+ * about, and none of the address spaces mapping it are in the middle of
+ * working on their pages (so nobody is holding on to its frame). **/
+static int coremap_ismovable(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+	int i;
+
+	if (CM_GET(page, STATE) != ALLOCATED || CM_GET(page, SIZE) != 1 ||
+			coremap_mapfirst(m) == -1 ||
+			CM_GET(page, REFCOUNT) != coremap_rmapcount(page)) {
+		return 0;
+	}
+
+	for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i)) {
+		if (!(coremap_mapaddr(m, i) & SWP_PAGE) || coremap_mapas(m, i)->as_busy > 0) {
+			return 0;
 		}
+	}
 
-		if (pages == npages) {
-			int page = i - (npages - 1);
-			last_page_used = i;
+	return 1;
+}
 
-			return page;
+/** Copies a user page to the free frame dest, which takes its place in
+ * every page table mapping it. The old frame is left fixed and belonging
+ * to nothing. **/
+static void coremap_migrate(unsigned int page, unsigned int dest) {
+	paddr_t paddr = (paddr_t) dest * PAGE_SIZE;
+	const struct coremap_mappings *m = &coremap[dest].u.used;
+	int i;
+
+	memmove((void *) PADDR_TO_KVADDR(paddr), (const void *) PADDR_TO_KVADDR((paddr_t) page * PAGE_SIZE), PAGE_SIZE);
+
+	// the mappings, references and swapfile copy all go with the page
+	coremap[dest].flags = coremap[page].flags;
+	coremap[dest].u.used = coremap[page].u.used;
+	coremap[dest].swapslot = coremap[page].swapslot;
+
+	for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i)) {
+		pt_notify_of_move(coremap_mapas(m, i)->as_pt, coremap_mapaddr(m, i), paddr);
+		vm_tlb_invalidate(coremap_mapas(m, i), coremap_mapaddr(m, i));
+	}
+
+	coremap[page].flags = 0;
+	CM_SET(page, STATE, FIXED);
+	coremap_clearused(page);
+
+	vmstats_inc(VMSTAT_COMPACT_MIGRATE);
+}
+
+/** Makes a block of npages free pages by moving the user pages in the way
+ * to frames elsewhere. The aligned block of the right order with the
+ * fewest pages to move is used, and the pages of the allocation are marked
+ * allocated as by coremap_getfreepages. Returns the first page of the block
+ * or -1 if no block could be cleared. Must be called with the coremap lock
+ * held, and doesn't release it, so the pages being moved can't be used or
+ * changed in the meantime. **/
+static int coremap_compact(unsigned long npages) {
+	unsigned int start, i, size;
+	int order = 0, best = -1;
+	unsigned int best_moves = 0, moves;
+
+	while ((1UL << order) < npages) {
+		order += 1;
+	}
+
+	if (order >= COREMAP_ORDERS) {
+		return -1;
+	}
+	size = 1 << order;
+
+	for (start = 0; start + size <= coremap_size; start += size) {
+		moves = 0;
+		for (i = start; i < start + size; i++) {
+			if (CM_GET(i, STATE) == FREE) {
+				continue;
+			}
+			if (!coremap_ismovable(i)) {
+				break;
+			}
+			moves++;
+		}
+
+		if (i == start + size && (best == -1 || moves < best_moves)) {
+			best = start;
+			best_moves = moves;
 		}
 	}
 
-	// check the start of the coremap, but don't count pages wrapping around
-	pages = 0;
-	for (i = 0; i < last_page_used; i++) {
-		if (coremap[i].state == FREE) {
-			pages += 1;
-		} else {
-			pages = 0;
+	// the pages have to have somewhere to go outside the block
+	if (best == -1 || coremap_getfreecount() - (size - best_moves) < best_moves) {
+		DEBUG(DB_COREMAP, "Unable to compact memory for an allocation of %lu pages.\n", npages);
+		return -1;
+	}
+
+	DEBUG(DB_COREMAP, "Compacting memory by moving %u pages out of pages %d to %d.\n", best_moves, best, best + size - 1);
+
+	// take the free blocks in the way off the free lists so the pages
+	// being moved aren't given frames inside the block
+	for (i = best; i < best + size;) {
+		int blockorder = coremap_getorder(i);
+		if (blockorder == -1) {
+			i++;
+			continue;
+		}
+
+		coremap_listremove(i);
+
+		unsigned int j;
+		for (j = i; j < i + (1U << blockorder); j++) {
+			CM_SET(j, STATE, FIXED);
+		}
+		i = j;
+	}
+
+	for (i = best; i < best + size; i++) {
+		if (CM_GET(i, STATE) != ALLOCATED) {
+			continue;
+		}
+
+		int dest = coremap_getfreepages(1);
+		if (dest == -1) {
+			// give the block back as it is now
+			for (i = best; i < best + size; i++) {
+				if (CM_GET(i, STATE) == FIXED) {
+					coremap_freerange(i, 1);
+				}
+			}
+			return -1;
+		}
+
+		coremap_migrate(i, dest);
+	}
+
+	coremap_takeblock(best, order, npages);
+
+	vmstats_inc(VMSTAT_COMPACT_SUCCESS);
+
+	return best;
+}
+
+#if SWAPPING_ENABLED
+/** Returns nonzero if the page can be swapped out, which is if it is:
+ *   not fixed (obviously)
+ *   allocated alone (because we have no way of swapping whole allocation blocks)
+ *   mapped by a page table (because the page table will store that it was swapped in the first place)
+ *   a user page rather than a page table (because nothing marks a table
+ *   busy while it is written out, and pt_destroy can't free a table that
+ *   isn't in memory)
+ *   only referenced by its mappings (because we can't tell the kernel, such
+ *   as the text cache, or mappings there was no room to record about it) **/
+static int coremap_isevictable(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+	int first = coremap_mapfirst(m);
+
+	return CM_GET(page, STATE) == ALLOCATED && CM_GET(page, SIZE) <= 1 &&
+			first != -1 && (coremap_mapaddr(m, first) & SWP_PAGE) &&
+			CM_GET(page, REFCOUNT) == coremap_rmapcount(page);
+}
+
+/** Returns nonzero if the page is mapped by an address space holding more
+ * pages than its page-fault-frequency allowance (see vm_fault), which is
+ * where pages are taken from first. **/
+static int coremap_isoverallowance(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+	int i;
+
+	for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i)) {
+		struct addrspace *as = coremap_mapas(m, i);
+		if (as->as_resident > as->as_allowance) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** Clears the referenced bit of a page. The page's TLB entry is dropped as
+ * well, and the page is flagged so the refill code leaves it to vm_fault,
+ * so that the next use of the page marks it again. **/
+static void coremap_clearreferenced(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+	int i;
+
+	CM_SET(page, REFERENCED, 0);
+
+	for (i = coremap_mapfirst(m); i != -1; i = coremap_mapnext(i)) {
+		if (coremap_mapaddr(m, i) & SWP_PAGE) {
+			pt_set_flags(coremap_mapas(m, i)->as_pt, coremap_mapaddr(m, i) & PAGE_FRAME, PAGE_UNREFERENCED_MASK);
+			vm_tlb_invalidate(coremap_mapas(m, i), coremap_mapaddr(m, i));
 		}
+	}
+}
+
+/** Picks the page to swap out with the clock (second chance) algorithm. Two
+ * sweeps are enough to find a page if there is one to be found. The first
+ * two only look at address spaces over their allowance. **/
+static int coremap_chooseclock() {
+	unsigned int i;
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < 2 * coremap_size; i++) {
+			unsigned int page = clock_hand;
+			clock_hand = (clock_hand + 1) % coremap_size;
+
+			if (!coremap_isevictable(page) || (pass == 0 && !coremap_isoverallowance(page))) {
+				continue;
+			}
 
-		if (pages == npages) {
-			int page = i - (npages - 1);
-			last_page_used = i;
+			if (CM_GET(page, REFERENCED)) {
+				coremap_clearreferenced(page);
+			} else {
+				return page;
+			}
+		}
+	}
 
+	return -1;
+}
+
+/** Picks the page to swap out randomly, trying address spaces over their
+ * allowance first. Gives up after a while so we don't spin forever when
+ * almost everything is fixed. **/
+static int coremap_chooserandom() {
+	unsigned int i;
+	for (i = 0; i < 2 * coremap_size; i++) {
+		unsigned int page = random() % coremap_size;
+
+		if (coremap_isevictable(page) && (i >= coremap_size || coremap_isoverallowance(page))) {
 			return page;
 		}
 	}
@@ -102,6 +693,263 @@ static int coremap_getfreepages(unsigned long npages) {
 	return -1;
 }
 
+static const struct {
+	const char *name;
+	int (*choose)(void);
+} policies[COREMAP_EVICT_COUNT] = {
+	{ "random",	coremap_chooserandom },
+	{ "clock",	coremap_chooseclock },
+};
+
+/** Picks the page to swap out with the policy in use. Must be called with
+ * the coremap lock held. **/
+static int coremap_choosevictim() {
+	return policies[coremap_policy].choose();
+}
+#endif
+
+#if SWAPPING_ENABLED
+/** Returns nonzero if the page hasn't been written since it was loaded, so
+ * that it can be loaded again the same way instead of being swapped. Page
+ * tables are written by the kernel directly and are never clean. **/
+static int coremap_isclean(unsigned int page) {
+	const struct coremap_mappings *m = &coremap[page].u.used;
+
+	return (coremap_mapaddr(m, coremap_mapfirst(m)) & SWP_PAGE) && !CM_GET(page, DIRTY);
+}
+
+/** Drops a clean page without writing it anywhere, unmapping it from every
+ * page table that has it. If the swapfile still has a copy of the page from
+ * when it was last swapped in, the entries point back at that copy.
+ * Otherwise they are made free again so the next fault reads the page from
+ * the executable or fills it with zeros. Must be called with the coremap
+ * lock held. Returns zero if the page was written in the meantime and has
+ * to be swapped out after all. **/
+static int coremap_discard(unsigned int page) {
+	int index = coremap[page].swapslot;
+	struct coremap_mappings mappings;
+	int i, nshares;
+
+	if (index != -1) {
+		// every page table mapping the page gets a reference of its own
+		// to the swapfile copy. Taking them can sleep, and if the page is
+		// written meanwhile coremap_setpagedirty gives one of them back.
+		nshares = coremap_rmapcount(page) - 1;
+		for (i = 0; i < nshares; i++) {
+			swapfile_share(index);
+		}
+
+		if (coremap[page].swapslot != index) {
+			for (i = 0; i < nshares; i++) {
+				swapfile_release(index, 1);
+			}
+			return 0;
+		}
+	}
+
+	mappings = coremap_rmapdetach(page);
+
+	if (index != -1) {
+		DEBUG(DB_COREMAP, "Evicting clean page %u to its copy in swapfile index %d.\n", page, index);
+		vmstats_inc(VMSTAT_SWAPCACHE_HIT);
+	} else {
+		DEBUG(DB_COREMAP, "Discarding clean page %u.\n", page);
+		vmstats_inc(VMSTAT_PAGEOUT_DISCARD);
+	}
+
+	for (i = coremap_mapfirst(&mappings); i != -1; i = coremap_mapnext(i)) {
+		struct addrspace *as = coremap_mapas(&mappings, i);
+		vaddr_t addr = coremap_mapaddr(&mappings, i);
+
+		if (index != -1) {
+			// the page tables own the swapfile page now
+			pt_notify_of_swap(as->as_pt, addr, index);
+		} else {
+			pt_notify_of_discard(as->as_pt, addr);
+		}
+		vm_tlb_invalidate(as, addr);
+	}
+
+	coremap_rmapfree(&mappings);
+
+	coremap_freerange(page, 1);
+	coremap_pages_in_use -= 1;
+
+	return 1;
+}
+
+/** Gives back the swapfile copies kept for up to npages clean pages when
+ * the swapfile is too full to swap out dirty ones. Those pages can't be
+ * loaded again from anywhere else, so they become dirty. Must be called
+ * with the coremap lock held. Returns the number of swapfile pages freed. **/
+static int coremap_dropswapcache(int npages) {
+	unsigned int i;
+	int freed = 0;
+
+	for (i = 0; i < coremap_size && freed < npages; i++) {
+		if (CM_GET(i, STATE) == FREE) {
+			continue;
+		}
+
+		int index = coremap[i].swapslot;
+		if (index != -1) {
+			coremap[i].swapslot = -1;
+			CM_SET(i, DIRTY, 1);
+			swapfile_release(index, 1);
+
+			vmstats_inc(VMSTAT_SWAPCACHE_DROP);
+			freed++;
+		}
+	}
+
+	return freed;
+}
+
+/** Swaps out up to maxpages pages with a single write to a contiguous run
+ * of the swapfile and gives their frames back to the free lists. Clean
+ * pages are dropped on the spot and don't need the write at all. A shared
+ * page is unmapped from every page table that has it, which all point at
+ * the same swapfile page afterwards. Must be called with the coremap lock
+ * held, which is released during the write. Returns the number of pages
+ * evicted. **/
+static int coremap_evict(int maxpages) {
+	int pages[SWAPFILE_CLUSTER_PAGES];
+	// the mappings taken off each page
+	struct coremap_mappings chains[SWAPFILE_CLUSTER_PAGES];
+	void *sources[SWAPFILE_CLUSTER_PAGES];
+	int i, j, npages, nclean;
+
+	if (maxpages > SWAPFILE_CLUSTER_PAGES) {
+		maxpages = SWAPFILE_CLUSTER_PAGES;
+	}
+
+	// collect the victims, fixing each one so it isn't picked twice
+	for (npages = 0, nclean = 0; npages + nclean < maxpages;) {
+		int page = coremap_choosevictim();
+		if (page == -1) {
+			break;
+		}
+
+		if (coremap_isclean(page) && coremap_discard(page)) {
+			nclean++;
+			continue;
+		}
+
+		pages[npages] = page;
+		sources[npages] = (void *) PADDR_TO_KVADDR((paddr_t) page * PAGE_SIZE);
+
+		// the page stops counting against its address spaces now, and
+		// nothing else can find its mappings while it is being written
+		chains[npages] = coremap_rmapdetach(page);
+		CM_SET(page, STATE, FIXED);
+		npages++;
+	}
+
+	if (npages == 0) {
+		if (nclean == 0) {
+			DEBUG(DB_COREMAP, "No page could be evicted.\n");
+		}
+		return nclean;
+	}
+
+	// find a run of the swapfile for them, settling for fewer pages if
+	// the swapfile is too fragmented
+	int index = -1;
+	while (npages > 0) {
+		index = swapfile_reserve(npages);
+		if (index != -1) {
+			break;
+		}
+
+		// copies kept for clean pages are the first thing to go
+		if (coremap_dropswapcache(npages) > 0) {
+			continue;
+		}
+
+		npages -= 1;
+		coremap_rmapattach(pages[npages], &chains[npages]);
+		CM_SET(pages[npages], STATE, ALLOCATED);
+	}
+
+	if (npages == 0) {
+		DEBUG(DB_COREMAP, "Out of swap space, so no dirty page can be evicted.\n");
+		return nclean;
+	}
+
+	DEBUG(DB_COREMAP, "Evicting %d pages from the coremap and swapping to swapfile index %d.\n", npages, index);
+
+	lock_release(coremap_lock);
+
+	for (i = 0; i < npages; i++) {
+		for (j = coremap_mapfirst(&chains[i]); j != -1; j = coremap_mapnext(j)) {
+			struct addrspace *as = coremap_mapas(&chains[i], j);
+			vaddr_t addr = coremap_mapaddr(&chains[i], j);
+
+			// every page table mapping the page holds a reference to
+			// the swapfile page
+			if (j != coremap_mapfirst(&chains[i])) {
+				swapfile_share(index + i);
+			}
+
+			// tell the page table that we've swapped the page out
+			pt_notify_of_swap(as->as_pt, addr, index + i);
+
+			// the page may still be in the TLB under its address space's
+			// ASID, and a fault on it has to wait until its swapfile copy
+			// is written
+			if (addr & SWP_PAGE) {
+				vm_tlb_invalidate(as, addr);
+				pt_set_busy(as->as_pt, addr);
+			}
+		}
+	}
+
+	// write the pages through their kernel addresses since the address
+	// spaces they belong to aren't necessarily the current one
+	swapfile_performkswapcluster(index, sources, npages);
+
+	for (i = 0; i < npages; i++) {
+		for (j = coremap_mapfirst(&chains[i]); j != -1; j = coremap_mapnext(j)) {
+			if (coremap_mapaddr(&chains[i], j) & SWP_PAGE) {
+				pt_clear_busy(coremap_mapas(&chains[i], j)->as_pt, coremap_mapaddr(&chains[i], j));
+			}
+		}
+	}
+
+	lock_acquire(coremap_lock);
+
+	for (i = 0; i < npages; i++) {
+		coremap_rmapfree(&chains[i]);
+		coremap_freerange(pages[i], 1);
+	}
+	coremap_pages_in_use -= npages;
+
+	return nclean + npages;
+}
+
+#endif
+
+int coremap_evictpages(int maxpages) {
+#if SWAPPING_ENABLED
+	int spl = splhigh();
+	lock_acquire(coremap_lock);
+
+	int result = coremap_evict(maxpages);
+
+	lock_release(coremap_lock);
+	splx(spl);
+
+	return result;
+#else
+	(void) maxpages;
+	return 0;
+#endif
+}
+
+unsigned int coremap_getfreecount() {
+	return coremap_size - coremap_pages_in_use;
+}
+
 paddr_t coremap_getpages(unsigned long npages) {
 	if (npages == 0) {
 		panic("Attempting to get 0 pages from the coremap.\n");
@@ -117,19 +965,52 @@ paddr_t coremap_getpages(unsigned long npages) {
 		// find npages consecutive pages in physical memory
 		int page = coremap_getfreepages(npages);
 
+		// cached text pages that nothing is running are the cheapest
+		// to give up since they can just be read again, followed by
+		// the frames kept zeroed for page faults
+		while (page == -1) {
+			lock_release(coremap_lock);
+			int freed = textcache_reclaim(npages);
+			if (freed == 0) {
+				freed = zeropool_reclaim(npages);
+			}
+			lock_acquire(coremap_lock);
+
+			if (freed == 0) {
+				break;
+			}
+			page = coremap_getfreepages(npages);
+		}
+
+		// there may be enough free pages, just not next to each other
+		if (page == -1 && npages > 1) {
+			page = coremap_compact(npages);
+		}
+
+#if SWAPPING_ENABLED
+		// we didn't find space so we need to do some swapping ourselves
+		// because the pageout thread didn't keep up
+		while (page == -1 && npages == 1 && coremap_evict(SWAPFILE_CLUSTER_PAGES) > 0) {
+			page = coremap_getfreepages(npages);
+		}
+
+		// a block of pages is made by swapping out enough pages that
+		// compaction has somewhere to move the rest of the block to
+		while (page == -1 && npages > 1 && coremap_evict(SWAPFILE_CLUSTER_PAGES) > 0) {
+			page = coremap_getfreepages(npages);
+			if (page == -1) {
+				page = coremap_compact(npages);
+			}
+		}
+#endif
+
 		if (page != -1) {
 			// we found space
-			coremap[page].addr = (vaddr_t) NULL;
-			coremap[page].addrspace = (struct addrspace *) NULL;
-			coremap[page].page_count = npages;
-			coremap[page].state = ALLOCATED;
+			CM_SET(page, SIZE, npages);
 
 			unsigned int i;
-			for (i = 1; i < npages; i++) {
-				coremap[page + i].addr = (vaddr_t) NULL;
-				coremap[page + i].addrspace = (struct addrspace *) NULL;
-				coremap[page + i].page_count = 0;
-				coremap[page + i].state = ALLOCATED;
+			for (i = 0; i < npages; i++) {
+				CM_SET(page + i, REFCOUNT, 1);
 			}
 
 			coremap_pages_in_use += npages;
@@ -140,94 +1021,123 @@ paddr_t coremap_getpages(unsigned long npages) {
 			paddr = (unsigned long) page * PAGE_SIZE;
 
 		} else {
-			// we didn't find space so we need to do some swapping
+			DEBUG(DB_COREMAP, "Out of memory for an allocation of %lu pages.\n", npages);
 
-#if SWAPFILE_ENABLED
-			// we have no way of handling swapping blocks at this point
-			if (npages != 1) {
-				panic("Attempting to swap out multiple pages for an allocation, which we can't do!\n");
-			}
+			paddr = (unsigned long) NULL;
+		}
 
-			// look for a page randomly which is:
-			//   not fixed (obviously)
-			//   allocated alone (because we have no way of swapping whole allocation blocks)
-			//   in an address space (because the page table will store that it was swapped in the first place)
-			//   has a virtual address (just a sanity check with the last one)
-			int page;
+		lock_release(coremap_lock);
 
-			do {
-				page = random() % coremap_size;
-			} while (coremap[page].state == FIXED || coremap[page].page_count > 1 ||
-					coremap[page].addrspace == NULL || coremap[page].addr == NULL);
+#if SWAPPING_ENABLED
+		// get the pageout thread going before we actually run out
+		pageout_notify(coremap_getfreecount());
+#endif
+	} else {
+		// just take some ram (which won't be swappable once the coremap is initialized)
+		DEBUG(DB_COREMAP, "Allocating %lu pages before coremap initialized.\n", npages);
 
-			int index = swapfile_prepareswap();
+		paddr = ram_stealmem(npages);
+	}
 
-			DEBUG(DB_COREMAP, "Evicting page %d from the coremap and swapping to swapfile index %d.", page, index);
+	splx(spl);
 
-			lock_release(coremap_lock);
+	return paddr;
+}
 
-			// tell the page table that we've swapped the page out
-			pt_notify_of_swap(coremap[page].addrspace->as_pt, coremap[page].addr, index);
+paddr_t coremap_trygetpage() {
+	assert(curspl > 0);
 
-			swapfile_performswap(index, coremap[page].addrspace, coremap[page].addr);
+	// with interrupts off nobody can take the lock from us, but whoever
+	// holds it may be in the middle of changing the free lists
+	if (!coremap_initialized || coremap_lock->owner != NULL) {
+		return (paddr_t) NULL;
+	}
 
-			lock_acquire(coremap_lock);
+	int page = coremap_getfreepages(1);
+	if (page == -1) {
+		return (paddr_t) NULL;
+	}
 
-			paddr = (unsigned long) page * PAGE_SIZE;
-#else
-			panic("Out of memory and we never got swapping working! Wee!\n");
+	CM_SET(page, SIZE, 1);
+	CM_SET(page, REFCOUNT, 1);
+	coremap_pages_in_use += 1;
 
-			paddr = (unsigned long) NULL;
-#endif
-		}
+	DEBUG(DB_COREMAP, "%u of %u pages in use after taking page %u without waiting.\n",
+			coremap_pages_in_use, coremap_size, page);
 
-		lock_release(coremap_lock);
-	} else {
-		// just take some ram (which won't be swappable once the coremap is initialized)
-		DEBUG(DB_COREMAP, "Allocating %lu pages before coremap initialized.\n", npages);
+	return (paddr_t) page * PAGE_SIZE;
+}
 
-		paddr = ram_stealmem(npages);
+/** Drops a reference to a page, freeing the pages allocated with it once
+ * nothing refers to it any more. Must be called with the coremap lock
+ * held. **/
+static void coremap_release(unsigned long page) {
+	paddr_t paddr = (paddr_t) page * PAGE_SIZE;
+
+	if (CM_GET(page, STATE) == FREE) {
+		panic("Attempting free on an unallocated page.\n");
 	}
 
-	splx(spl);
+	if (CM_GET(page, REFCOUNT) > 1) {
+		// someone else still shares the page so just drop our reference
+		CM_SET(page, REFCOUNT, CM_GET(page, REFCOUNT) - 1);
 
-	return paddr;
+		DEBUG(DB_COREMAP, "Dropped a reference to shared page %lu (%u left).\n", page, CM_GET(page, REFCOUNT));
+		return;
+	}
+
+	// nothing will ask for the swapfile copy of the page any more
+	if (coremap[page].swapslot != -1) {
+		swapfile_release(coremap[page].swapslot, 1);
+		coremap[page].swapslot = -1;
+	}
+
+	unsigned long npages = CM_GET(page, SIZE);
+	if (npages != 0) {
+		// we're at the start of an allocation block so we can free the pages in the block
+		unsigned int i;
+		for (i = 0; i < npages; i++) {
+			if (CM_GET(page + i, STATE) == FREE) {
+				panic("Attempting free on an unallocated page.\n");
+			}
+		}
+
+		struct coremap_mappings mappings = coremap_rmapdetach(page);
+		coremap_rmapfree(&mappings);
+
+		if (npages == 1 && zeropool_putpage(paddr)) {
+			// the pool keeps the page to zero it while idle, so it
+			// stays allocated but no longer belongs to anything
+			CM_SET(page, STATE, ALLOCATED);
+			CM_SET(page, REFERENCED, 0);
+			CM_SET(page, DIRTY, 0);
+			return;
+		}
+
+		coremap_freerange(page, npages);
+
+		coremap_pages_in_use -= npages;
+
+#if SWAPPING_ENABLED
+		pageout_pagefreed();
+#endif
+
+		DEBUG(DB_COREMAP, "%u of %u pages in use after free of %lu pages.\n", coremap_pages_in_use, coremap_size, npages);
+	} else {
+		DEBUG(DB_COREMAP, "Attempting free in the middle of an allocation block.\n");
+	}
 }
 
 void coremap_freepages(paddr_t paddr) {
 	if (coremap_initialized) {
 		int spl = splhigh();
 
-		unsigned long page = paddr / PAGE_SIZE;
-
 		if (paddr % PAGE_SIZE != 0) {
 			DEBUG(DB_COREMAP, "Attempting free in the middle of a page. This might not matter though.\n");
 		}
 
 		lock_acquire(coremap_lock);
-
-		unsigned long npages = coremap[page].page_count;
-		if (npages != 0) {
-			// we're at the start of an allocation block so we can free the pages in the block
-			unsigned int i;
-			for (i = 0; i < npages; i++) {
-				if (coremap[page + i].state == ALLOCATED || coremap[page + i].state == FIXED) {
-					coremap[page + i].addr = (vaddr_t) NULL;
-					coremap[page + i].addrspace = (struct addrspace *) NULL;
-					coremap[page + i].page_count = 0;
-					coremap[page + i].state = FREE;
-				} else {
-					DEBUG(DB_COREMAP, "Attempting free on an unallocated page.\n");
-				}
-			}
-
-			coremap_pages_in_use -= npages;
-
-			DEBUG(DB_COREMAP, "%u of %u pages in use after free of %lu pages.\n", coremap_pages_in_use, coremap_size, npages);
-		} else {
-			DEBUG(DB_COREMAP, "Attempting free in the middle of an allocation block.\n");
-		}
-
+		coremap_release(paddr / PAGE_SIZE);
 		lock_release(coremap_lock);
 
 		splx(spl);
@@ -236,6 +1146,23 @@ void coremap_freepages(paddr_t paddr) {
 	}
 }
 
+void coremap_unmappage(paddr_t paddr, struct addrspace *addrspace) {
+	int spl = splhigh();
+
+	unsigned long page = paddr / PAGE_SIZE;
+
+	lock_acquire(coremap_lock);
+
+	if (CM_GET(page, STATE) != FREE) {
+		coremap_rmapremove(page, addrspace);
+	}
+	coremap_release(page);
+
+	lock_release(coremap_lock);
+
+	splx(spl);
+}
+
 int coremap_ispagefixed(paddr_t paddr) {
 	if (paddr % PAGE_SIZE != 0) {
 		DEBUG(DB_COREMAP, "Warning: paddr for coremap_ispagefixed is not page-aligned.\n");
@@ -243,29 +1170,34 @@ int coremap_ispagefixed(paddr_t paddr) {
 
 	unsigned long page = paddr / PAGE_SIZE;
 
-	return coremap[page].state == FIXED;
+	return CM_GET(page, STATE) == FIXED;
 }
 
+// The flags of an entry are only changed with interrupts disabled, since
+// the fields that are set without the lock share the word with the rest.
+
 void coremap_setpagefixed(paddr_t paddr, int fixed) {
 	if (paddr % PAGE_SIZE != 0) {
 		DEBUG(DB_COREMAP, "Warning: paddr for coremap_setpagefixed is not page-aligned.\n");
 	}
 
+	int spl = splhigh();
 	lock_acquire(coremap_lock);
 
 	unsigned long page = paddr / PAGE_SIZE;
 
-	if (coremap[page].state != FREE) {
+	if (CM_GET(page, STATE) != FREE) {
 		if (fixed) {
-			coremap[page].state = FIXED;
+			CM_SET(page, STATE, FIXED);
 		} else {
-			coremap[page].state = ALLOCATED;
+			CM_SET(page, STATE, ALLOCATED);
 		}
 	} else {
 		DEBUG(DB_COREMAP, "Warning: Attempting to set free page to be %s.\n", (fixed == 0 ? "swappable" : "fixed"));
 	}
 
 	lock_release(coremap_lock);
+	splx(spl);
 }
 
 void coremap_getpagevaddr(paddr_t paddr, struct addrspace **addrspace, vaddr_t *vaddr) {
@@ -275,9 +1207,11 @@ void coremap_getpagevaddr(paddr_t paddr, struct addrspace **addrspace, vaddr_t *
 
 	unsigned long page = paddr / PAGE_SIZE;
 
-	if (coremap[page].state != FREE) {
-		*addrspace = coremap[page].addrspace;
-		*vaddr = coremap[page].addr;
+	if (CM_GET(page, STATE) != FREE) {
+		const struct coremap_mappings *m = &coremap[page].u.used;
+		int first = coremap_mapfirst(m);
+		*addrspace = (first != -1 ? coremap_mapas(m, first) : NULL);
+		*vaddr = (first != -1 ? coremap_mapaddr(m, first) : (vaddr_t) NULL);
 	} else {
 		DEBUG(DB_COREMAP, "Warning: Attempting to get the vaddr of a free page.\n");
 	}
@@ -288,16 +1222,153 @@ void coremap_setpagevaddr(paddr_t paddr, struct addrspace *addrspace, vaddr_t va
 		DEBUG(DB_COREMAP, "Warning: paddr for coremap_setpagevaddr is not page-aligned.\n");
 	}
 
+	int spl = splhigh();
 	lock_acquire(coremap_lock);
 
 	unsigned long page = paddr / PAGE_SIZE;
 
-	if (coremap[page].state != FREE) {
-		coremap[page].addrspace = addrspace;
-		coremap[page].addr = vaddr;
+	if (CM_GET(page, STATE) != FREE) {
+		struct coremap_mappings mappings = coremap_rmapdetach(page);
+		coremap_rmapfree(&mappings);
+		if (addrspace != NULL) {
+			coremap_rmapadd(page, addrspace, vaddr);
+		}
 	} else {
-		DEBUG(DB_COREMAP, "Warning: Attempting to get the vaddr of a free page.\n");
+		DEBUG(DB_COREMAP, "Warning: Attempting to set the vaddr of a free page.\n");
+	}
+
+	lock_release(coremap_lock);
+	splx(spl);
+}
+
+void coremap_addmapping(paddr_t paddr, struct addrspace *addrspace, vaddr_t vaddr) {
+	int spl = splhigh();
+	lock_acquire(coremap_lock);
+
+	unsigned long page = paddr / PAGE_SIZE;
+
+	if (CM_GET(page, STATE) != FREE) {
+		coremap_rmapadd(page, addrspace, vaddr);
+	} else {
+		DEBUG(DB_COREMAP, "Warning: Attempting to map a free page.\n");
+	}
+
+	lock_release(coremap_lock);
+	splx(spl);
+}
+
+void coremap_setpagereferenced(paddr_t paddr) {
+	unsigned long page = paddr / PAGE_SIZE;
+
+	// no lock since this is only a hint and is set from vm_fault
+	int spl = splhigh();
+	CM_SET(page, REFERENCED, 1);
+	splx(spl);
+}
+
+void coremap_setpagedirty(paddr_t paddr) {
+	unsigned long page = paddr / PAGE_SIZE;
+
+	// no lock for the same reason, and a page only ever becomes dirty
+	// while it is mapped so it can't be freed at the same time
+	int spl = splhigh();
+	int index = coremap[page].swapslot;
+
+	CM_SET(page, DIRTY, 1);
+
+	// the copy in the swapfile is out of date now
+	if (index != -1) {
+		coremap[page].swapslot = -1;
+		swapfile_release(index, 1);
+	}
+	splx(spl);
+}
+
+void coremap_setswapslot(paddr_t paddr, int index) {
+	unsigned long page = paddr / PAGE_SIZE;
+
+	assert(coremap[page].swapslot == -1);
+	coremap[page].swapslot = index;
+}
+
+void coremap_sharepage(paddr_t paddr) {
+	if (paddr % PAGE_SIZE != 0) {
+		DEBUG(DB_COREMAP, "Warning: paddr for coremap_sharepage is not page-aligned.\n");
+	}
+
+	int spl = splhigh();
+	lock_acquire(coremap_lock);
+
+	unsigned long page = paddr / PAGE_SIZE;
+
+	if (CM_GET(page, STATE) != FREE) {
+		assert(CM_GET(page, SIZE) <= 1);
+		assert(CM_GET(page, REFCOUNT) < COREMAP_REFCOUNT_MASK >> COREMAP_REFCOUNT_SHIFT);
+		CM_SET(page, REFCOUNT, CM_GET(page, REFCOUNT) + 1);
+	} else {
+		DEBUG(DB_COREMAP, "Warning: Attempting to share a free page.\n");
 	}
 
 	lock_release(coremap_lock);
+	splx(spl);
+}
+
+unsigned int coremap_getrefcount(paddr_t paddr) {
+	if (paddr % PAGE_SIZE != 0) {
+		DEBUG(DB_COREMAP, "Warning: paddr for coremap_getrefcount is not page-aligned.\n");
+	}
+
+	unsigned long page = paddr / PAGE_SIZE;
+
+	return CM_GET(page, REFCOUNT);
+}
+
+int coremap_setpolicy(const char *name) {
+#if SWAPPING_ENABLED
+	int i;
+
+	for (i = 0; i < COREMAP_EVICT_COUNT; i++) {
+		if (!strcmp(name, policies[i].name)) {
+			int spl = splhigh();
+			lock_acquire(coremap_lock);
+			coremap_policy = i;
+			lock_release(coremap_lock);
+			splx(spl);
+
+			return 0;
+		}
+	}
+#else
+	(void) name;
+#endif
+
+	return EINVAL;
+}
+
+const char *coremap_getpolicy() {
+#if SWAPPING_ENABLED
+	return policies[coremap_policy].name;
+#else
+	return "none";
+#endif
+}
+
+void coremap_printstats() {
+	int spl = splhigh();
+	lock_acquire(coremap_lock);
+
+	unsigned int i, free_pages = 0;
+
+	kprintf("Coremap: %u of %u pages in use\n", coremap_pages_in_use, coremap_size);
+	kprintf("%6s %10s %10s\n", "order", "blocks", "pages");
+	for (i = 0; i < COREMAP_ORDERS; i++) {
+		kprintf("%6u %10u %10u\n", i, free_blocks[i], free_blocks[i] << i);
+		free_pages += free_blocks[i] << i;
+	}
+	kprintf("%6s %10s %10u\n", "total", "", free_pages);
+	kprintf("Reverse mappings: %u of %u in use (%u pages)\n", rmap_in_use,
+			rmap_npages * RMAP_PER_PAGE, rmap_npages);
+
+	lock_release(coremap_lock);
+	splx(spl);
 }
@@ -0,0 +1,116 @@
+#include <pageout.h>
+
+#include <coremap.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <swapfile.h>
+#include <textcache.h>
+#include <thread.h>
+#include <uw-vmstats.h>
+#include <vm.h>
+#include <zeropool.h>
+
+// the number of free pages at which the thread wakes up and stops
+static unsigned int low_watermark;
+static unsigned int high_watermark;
+
+// nonzero once the thread is running
+static int pageout_started = 0;
+
+// the fewest free pages there have been after an allocation since the
+// thread started, to see how well it keeps up
+static unsigned int pageout_minfree;
+
+// the address the pageout thread sleeps on
+static int pageout_sleepaddr;
+
+// set when a pass freed nothing, so the thread waits for a page to be
+// freed or asked for before trying again rather than spinning
+static int pageout_stalled = 0;
+
+static void pageout_thread(void *data1, unsigned long data2) {
+	(void) data1;
+	(void) data2;
+
+	while (1) {
+		int spl = splhigh();
+		while (pageout_stalled || coremap_getfreecount() >= low_watermark) {
+			thread_sleep(&pageout_sleepaddr);
+		}
+		splx(spl);
+
+		vmstats_inc(VMSTAT_PAGEOUT_WAKEUP);
+
+		DEBUG(DB_COREMAP, "Pageout thread woke up with %u pages free.\n", coremap_getfreecount());
+
+		// unused text pages go first since they don't need writing out,
+		// then the frames kept zeroed for page faults
+		unsigned int free_pages = coremap_getfreecount();
+		if (free_pages < high_watermark) {
+			textcache_reclaim(high_watermark - free_pages);
+		}
+		free_pages = coremap_getfreecount();
+		if (free_pages < high_watermark) {
+			zeropool_reclaim(high_watermark - free_pages);
+		}
+
+		while ((free_pages = coremap_getfreecount()) < high_watermark) {
+			int evicted = coremap_evictpages(high_watermark - free_pages);
+			if (evicted == 0) {
+				// there's nothing left that we can swap out for now
+				spl = splhigh();
+				pageout_stalled = 1;
+				splx(spl);
+				break;
+			}
+
+			while (evicted-- > 0) {
+				vmstats_inc(VMSTAT_PAGEOUT_EVICT);
+			}
+		}
+	}
+}
+
+void pageout_bootstrap() {
+	unsigned int free_pages = coremap_getfreecount();
+
+	low_watermark = free_pages * PAGEOUT_LOW_WATERMARK_PERCENT / 100;
+	high_watermark = free_pages * PAGEOUT_HIGH_WATERMARK_PERCENT / 100;
+
+	if (low_watermark < 1) low_watermark = 1;
+	if (high_watermark <= low_watermark) high_watermark = low_watermark + 1;
+
+	vmstats_set(VMSTAT_PAGEOUT_LOW_WATERMARK, low_watermark);
+	vmstats_set(VMSTAT_PAGEOUT_HIGH_WATERMARK, high_watermark);
+
+	pageout_minfree = free_pages;
+	vmstats_set(VMSTAT_PAGEOUT_MIN_FREE, pageout_minfree);
+
+	int err = thread_fork("pageout", NULL, 0, pageout_thread, NULL);
+	if (err != 0) panic("Unable to start the pageout thread: %s\n", strerror(err));
+
+	pageout_started = 1;
+}
+
+void pageout_notify(unsigned int free_pages) {
+	assert(curspl > 0);
+
+	if (pageout_started && free_pages < pageout_minfree) {
+		pageout_minfree = free_pages;
+		vmstats_set(VMSTAT_PAGEOUT_MIN_FREE, pageout_minfree);
+	}
+
+	if (pageout_started && free_pages < low_watermark) {
+		pageout_stalled = 0;
+		thread_wakeup(&pageout_sleepaddr);
+	}
+}
+
+void pageout_pagefreed() {
+	assert(curspl > 0);
+
+	if (pageout_stalled) {
+		pageout_stalled = 0;
+		thread_wakeup(&pageout_sleepaddr);
+	}
+}
@@ -8,10 +8,18 @@
 #include <kern/errno.h>
 #include <thread.h>
 #include <curthread.h>
+#include <zeropool.h>
+#include <machine/spl.h>
 
 #include <uw-vmstats.h>
 
 
+// a frame of zeros the kernel keeps to map pages that have only been read
+static paddr_t zero_paddr;
+
+// what threads waiting for a busy page sleep on
+static int busy_channel;
+
 
 static struct pagetable *_pt_create(int permissions, vaddr_t vaddr) {
 	int i;
@@ -33,7 +41,6 @@ static struct pagetable *_pt_create(int permissions, vaddr_t vaddr) {
 
 
 static paddr_t _pt_create_page(vaddr_t vaddr) {
-	int i;
 	paddr_t paddr = (paddr_t)coremap_getpages(1);
 	// TODO - HJOLY FUCK ALSHLFKSAFHLKhj
 	if (paddr==(paddr_t)NULL) {
@@ -43,9 +50,25 @@ static paddr_t _pt_create_page(vaddr_t vaddr) {
 	vaddr |= SWP_PAGE;
 	coremap_setpagevaddr(paddr, curthread->t_vmspace, vaddr);
 
-	// for (i = 0; i < PAGE_SIZE/4; i += 1) {
-	// 	((int*)paddr)[i] = 0;
-	// }
+	return paddr;
+}
+
+
+// Same as _pt_create_page but the page is all zeros. One zeroed while the
+// CPU was idle is used if there is one ready.
+static paddr_t _pt_create_zeroed_page(vaddr_t vaddr) {
+	paddr_t paddr = zeropool_getpage();
+	if (paddr == (paddr_t) NULL) {
+		paddr = _pt_create_page(vaddr);
+		if (paddr != (paddr_t) NULL) {
+			bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		}
+		return paddr;
+	}
+
+	vaddr &= PAGE_FRAME;
+	vaddr |= SWP_PAGE;
+	coremap_setpagevaddr(paddr, curthread->t_vmspace, vaddr);
 
 	return paddr;
 }
@@ -105,11 +128,12 @@ static int get_pagetable(struct pagetable *pt,
 		}
 	} else if (state == PAGE_IN_SWP) {
 		if (create) {
-			// TODO load from swap file
 			*dst = _pt_create(0, vaddr);
-			swapfile_getpage((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, (void*)dst);
-			*dst = (struct pagetable*)((paddr_t)*dst | (paddr_t)(PAGE_IN_MEM | (value & (PAGE_R_MASK | PAGE_W_MASK | PAGE_X_MASK))));
-			set_value(pt, offset, ((int)*dst));
+			if (*dst == NULL) {
+				return state;
+			}
+			swapfile_getpage((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, (void*)*dst);
+			set_value(pt, offset, ((int)*dst) | PAGE_IN_MEM_MASK | (value & (PAGE_R_MASK | PAGE_W_MASK | PAGE_X_MASK)));
 			return 0;
 		}
 	} else {
@@ -132,9 +156,12 @@ static int get_page(struct pagetable *pt,
 	if (state == PAGE_FREE) {
 		*dst = PAGE_FREE;
 		if (create) {
-			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
-			*dst = _pt_create_page(vaddr) | (paddr_t)(PAGE_IN_MEM_MASK | permissions);
-			// TODO - set coremap vaddr
+			// a new page has to start out as zeros
+			*dst = _pt_create_zeroed_page(vaddr);
+			if (*dst == (paddr_t) NULL) {
+				return state;
+			}
+			*dst = *dst | (paddr_t)(PAGE_IN_MEM_MASK | permissions);
 			set_value(pt, offset, ((int)*dst));
 			return 0;
 		}
@@ -142,9 +169,15 @@ static int get_page(struct pagetable *pt,
 		*dst = PAGE_IN_SWP;
 		if (create) {
 			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
-			// TODO - load from swap file
 			*dst = _pt_create_page(vaddr);
-			swapfile_getpage((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, (void*)dst);
+			if (*dst == (paddr_t) NULL) {
+				*dst = PAGE_IN_SWP;
+				return state;
+			}
+			// the swapfile copy is kept until the page is written, so
+			// the page can go back to it without being written out
+			swapfile_readpage((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, (void*)PADDR_TO_KVADDR(*dst));
+			coremap_setswapslot(*dst, (value & PAGE_FRAME) >> ADDR_LOW_SHIFT);
 			// TODO - set coremap vaddr
 			*dst = *dst | (paddr_t)(PAGE_IN_MEM_MASK | permissions);
 			set_value(pt, offset, ((int)*dst));
@@ -159,7 +192,15 @@ static int get_page(struct pagetable *pt,
 
 
 
-static void destroy_nested_pagetable(int value) {
+// Drops the address space's mapping of a frame. The zero page is mapped by
+// far too many pages to count, so it is never counted or dropped.
+static void pt_dropframe(paddr_t paddr, struct addrspace *as) {
+	if (paddr != zero_paddr) {
+		coremap_unmappage(paddr, as);
+	}
+}
+
+static void destroy_nested_pagetable(int value, struct addrspace *as) {
 	int i;
 	struct pagetable *pt;
 	int state = get_page_state_by_value(value);
@@ -176,6 +217,16 @@ static void destroy_nested_pagetable(int value) {
 	// Go through and free all the pages allocated
 	for (i = 0; i < PAGE_SIZE/4; i += 1) {
 		value = get_value(pt, i);
+
+		// a page still being written out is freed once it gets there
+		if (value & PAGE_BUSY_MASK) {
+			int spl = splhigh();
+			while ((value = get_value(pt, i)) & PAGE_BUSY_MASK) {
+				pt_wait_busy();
+			}
+			splx(spl);
+		}
+
 		state = get_page_state_by_value(value);
 
 		if (state == PAGE_FREE) {
@@ -183,9 +234,9 @@ static void destroy_nested_pagetable(int value) {
 		}
 
 		if (state == PAGE_IN_SWP) {
-			// TODO - remove the page from swap file
+			swapfile_release((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, 1);
 		} else {
-			coremap_freepages((paddr_t) (value & PAGE_FRAME));
+			pt_dropframe((paddr_t) (value & PAGE_FRAME), as);
 		}
 	}
 
@@ -194,6 +245,18 @@ static void destroy_nested_pagetable(int value) {
 
 
 
+void pt_bootstrap() {
+	zero_paddr = coremap_getpages(1);
+	if (zero_paddr == (paddr_t) NULL) panic("Unable to allocate the zero page.\n");
+
+	bzero((void *) PADDR_TO_KVADDR(zero_paddr), PAGE_SIZE);
+
+	// the kernel's reference is never dropped so the page is never freed
+	// or handed to an address space by pt_copy_on_write, and the pages
+	// that map it don't take references of their own
+	coremap_setpagefixed(zero_paddr, 1);
+}
+
 struct pagetable *pt_create() {
 	struct pagetable *pt = _pt_create(0, (vaddr_t)NULL);
 	coremap_setpagefixed((paddr_t)(pt)-0x80000000, 1);
@@ -201,10 +264,11 @@ struct pagetable *pt_create() {
 }
 
 
-void pt_destroy(struct pagetable *pt) {
+void pt_destroy(struct addrspace *as) {
+	struct pagetable *pt = as->as_pt;
 	int i;
 	for (i = 0; i < PAGE_SIZE/4; i += 1) {
-		destroy_nested_pagetable(get_value(pt, i));
+		destroy_nested_pagetable(get_value(pt, i), as);
 	}
 	free_kpages((vaddr_t)pt);
 }
@@ -244,25 +308,80 @@ int pt_set_permissions(struct pagetable *pt, vaddr_t vaddr,
 	return 0;
 }
 
-static int vaddr_overlap(vaddr_t l1, vaddr_t r1, vaddr_t l2, vaddr_t r2) {
-	//  |(l1)    |(l2)  |(r2)   |(r1)
-	if (r1 >= r2 && r2 >= l1) return 1;
-	//  |(l1)    |(l2)  |(r1)   |(r2)
-	if (l1 <= l2 && r1 > l2) return 1;
-	
+void pt_set_flags(struct pagetable *pt, vaddr_t vaddr, int flags) {
+	int offset, value;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt != NULL) {
+		offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+		value = get_value(spt, offset);
+		if (get_page_state_by_value(value) == PAGE_IN_MEM) {
+			set_value(spt, offset, value | flags);
+		}
+	}
+}
+
+void pt_clear_flags(struct pagetable *pt, vaddr_t vaddr, int flags) {
+	int offset, value;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt != NULL) {
+		offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+		value = get_value(spt, offset);
+		if (get_page_state_by_value(value) == PAGE_IN_MEM) {
+			set_value(spt, offset, value & ~flags);
+		}
+	}
+}
+
+// Shares the page at the given offset of the page table with another page
+// table. The page is made read-only in both and flagged copy-on-write if it
+// was writable, so the first write from either side gets its own copy.
+static int share_page(struct pagetable *pt, int offset, struct addrspace *dst, vaddr_t vaddr) {
+	int value;
+	paddr_t paddr;
+	struct pagetable *dpt;
+
+	// Get the destination table first so allocating it can't take
+	// the page away from under us
+	get_pagetable(dst->as_pt, vaddr, 1, 0, &dpt);
+	if (dpt == NULL) {
+		return ENOMEM;
+	}
+
+	// If the page is in the swapfile we need it to be
+	// back in memory so we call get_page with create
+	if (get_page(pt, offset, 1, vaddr, &paddr)) {
+		return ENOMEM;
+	}
+
+	value = get_value(pt, offset);
+	if (value & (PAGE_W_MASK | PAGE_COW_MASK)) {
+		value = (value & ~PAGE_W_MASK) | PAGE_COW_MASK;
+		set_value(pt, offset, value);
+	}
+
+	// the page is swapped out of both page tables together, so the
+	// coremap has to know about each of them
+	if ((paddr_t) (value & PAGE_FRAME) != zero_paddr) {
+		coremap_sharepage((paddr_t) (value & PAGE_FRAME));
+		coremap_addmapping((paddr_t) (value & PAGE_FRAME), dst, (vaddr & PAGE_FRAME) | SWP_PAGE);
+	}
+	set_value(dpt, offset, value);
+
 	return 0;
 }
 
-int pt_copy(struct pagetable *dst, struct addrspace *as) {
+int pt_copy(struct addrspace *dst, struct addrspace *as) {
 	int idx_count = PAGE_SIZE/4;
-	int pt_idx1, pt_idx2, r_idx;
-	int value, in_region;
+	int pt_idx1, pt_idx2;
+	int value;
 	int state, permissions;
 	struct pagetable *pt1 = as->as_pt;
-	struct pagetable *pt2;
-	struct region *region;
-	vaddr_t vaddr, rbot, rtop;
-	paddr_t paddr1, paddr2;
+	struct pagetable *pt2, *dpt;
+	vaddr_t vaddr;
 
 	for (pt_idx1 = 0; pt_idx1 < idx_count; pt_idx1++) {
 		value = get_value(pt1, pt_idx1);
@@ -274,6 +393,9 @@ int pt_copy(struct pagetable *dst, struct addrspace *as) {
 			// If the page is in the swapfile we need it to be
 			// back in memory so we call get_pagetable with create
 			get_pagetable(pt1, vaddr, 1, permissions, &pt2);
+			if (pt2 == NULL) {
+				return ENOMEM;
+			}
 
 			for (pt_idx2 = 0; pt_idx2 < idx_count; pt_idx2++) {
 				value = get_value(pt2, pt_idx2);
@@ -281,54 +403,234 @@ int pt_copy(struct pagetable *dst, struct addrspace *as) {
 
 				if (state != PAGE_FREE) {
 					vaddr = (vaddr_t)( (pt_idx1 << (ADDR_UP_SHIFT)) + (pt_idx2 << (ADDR_LOW_SHIFT)) );
-					permissions = value & (PAGE_W_MASK | PAGE_R_MASK | PAGE_X_MASK);
-					in_region = 0;
-
-					for (r_idx = 0; r_idx < as->as_region_count &&
-							!(permissions & PAGE_W_MASK); r_idx++) {
-						region = &as->as_regions[r_idx];
-						rbot = region->vaddr;
-						rtop = rbot + region->memsize;
-
-						if (vaddr_overlap(vaddr, vaddr+PAGE_SIZE,
-										rbot, rtop)) {
-							in_region = 1;
-							break;
-						}
+
+					// Rather than copying the page we share it with the
+					// new page table until one of them writes to it.
+					// Pages that were never touched stay free and get
+					// loaded properly on a vm_fault.
+					if (share_page(pt2, pt_idx2, dst, vaddr)) {
+						return ENOMEM;
 					}
+				}
+			}
 
-					// We don't want to copy memory that is contained
-					// within a defined region because it will be loaded
-					// properly on a vm_fault with permissions and
-					// everything set correctly.
-					if (!in_region) {
-						// TODO - force page to load with get_page
-						// TODO - copy the page
+			// the new tables were made by this thread, which isn't the
+			// address space that has them
+			vaddr = (vaddr_t)(pt_idx1 << (ADDR_UP_SHIFT));
+			get_pagetable(dst->as_pt, vaddr, 0, 0, &dpt);
+			if (dpt != NULL) {
+				coremap_setpagevaddr((paddr_t)(dpt)-0x80000000, dst, vaddr | SWP_TABLE);
+			}
+		}
+	}
 
-						// Get the page and its physical address
-						get_page(pt2, pt_idx2, 1, vaddr, &paddr1);
+	return 0;
+}
 
-						coremap_setpagefixed(paddr1, 1);
+paddr_t pt_copy_on_write(struct pagetable *pt, vaddr_t vaddr) {
+	int offset, value;
+	struct pagetable *spt;
+	paddr_t paddr, newpaddr;
 
-						paddr2 = pt_get_paddr(dst, vaddr, 1, permissions);
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt == NULL) {
+		return (paddr_t) NULL;
+	}
 
-						coremap_setpagefixed(paddr2, 1);
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	value = get_value(spt, offset);
+	assert(get_page_state_by_value(value) == PAGE_IN_MEM);
 
-						memmove((void *)(PADDR_TO_KVADDR(paddr2) & PAGE_FRAME),
-								(const void *)(PADDR_TO_KVADDR(paddr1) & PAGE_FRAME), PAGE_SIZE);
+	if (!(value & PAGE_COW_MASK)) {
+		return (paddr_t) (value & 0xFFFFFFFC);
+	}
 
-						coremap_setpagefixed(paddr1, 0);
-						coremap_setpagefixed(paddr2, 0);
+	paddr = (paddr_t) (value & PAGE_FRAME);
 
-					}
-				}
-			}
+	if (coremap_getrefcount(paddr) > 1 || paddr == zero_paddr) {
+		// Somebody else still has the page so we get our own copy
+		if (paddr == zero_paddr) {
+			newpaddr = _pt_create_zeroed_page(vaddr);
+		} else {
+			newpaddr = _pt_create_page(vaddr);
+		}
+		if (newpaddr == (paddr_t) NULL) {
+			return (paddr_t) NULL;
 		}
+
+		if (paddr != zero_paddr) {
+			memmove((void *) PADDR_TO_KVADDR(newpaddr),
+					(const void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		} else {
+			// the first write to a page that was only read so far, which
+			// isn't a page fault of its own so isn't in the zeroed counts
+			vmstats_inc(VMSTAT_ZERO_PAGE_COPY);
+		}
+
+		// Drop our reference to the shared page
+		pt_dropframe(paddr, curthread->t_vmspace);
+
+		// the copy is a fresh frame that vm_fault marks dirty itself
+		value = (value & ~(PAGE_FRAME | PAGE_DIRTY_MASK)) | newpaddr;
 	}
 
+	// Either way the page is now only ours and can be written
+	value = (value & ~PAGE_COW_MASK) | PAGE_W_MASK;
+	set_value(spt, offset, value);
+
+	return (paddr_t) (value & 0xFFFFFFFC);
+}
+
+// Maps an already allocated (usually shared) frame at a free virtual
+// address. The caller's reference to the frame is handed to the page table.
+int pt_map_page(struct pagetable *pt, vaddr_t vaddr, paddr_t paddr, int permissions) {
+	int offset;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 1, 0, &spt);
+	if (spt == NULL) {
+		return ENOMEM;
+	}
+
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	assert(get_page_state(spt, offset) == PAGE_FREE);
+
+	// every address space maps the zero page, which is never swapped
+	if ((paddr & PAGE_FRAME) != zero_paddr) {
+		coremap_addmapping(paddr & PAGE_FRAME, curthread->t_vmspace, (vaddr & PAGE_FRAME) | SWP_PAGE);
+	}
+
+	set_value(spt, offset, (int) ((paddr & PAGE_FRAME) | PAGE_IN_MEM_MASK | permissions));
+
 	return 0;
 }
 
+// Maps the zero page at a free virtual address for reading. If the page is
+// meant to be writable it is mapped copy-on-write so that the first write
+// gets a private zeroed page.
+paddr_t pt_map_zero(struct pagetable *pt, vaddr_t vaddr, int permissions) {
+	if (permissions & PAGE_W_MASK) {
+		permissions = (permissions & ~PAGE_W_MASK) | PAGE_COW_MASK;
+	}
+
+	if (pt_map_page(pt, vaddr, zero_paddr, permissions)) {
+		return (paddr_t) NULL;
+	}
+
+	return zero_paddr | PAGE_IN_MEM_MASK | permissions;
+}
+
+void pt_unmap_page(struct addrspace *as, vaddr_t vaddr) {
+	int offset, value, state;
+	struct pagetable *spt;
+
+	get_pagetable(as->as_pt, vaddr, 0, 0, &spt);
+	if (spt == NULL) {
+		return;
+	}
+
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	value = get_value(spt, offset);
+
+	// a page still being written out or read in is freed once it gets there
+	if (value & PAGE_BUSY_MASK) {
+		int spl = splhigh();
+		while ((value = get_value(spt, offset)) & PAGE_BUSY_MASK) {
+			pt_wait_busy();
+		}
+		splx(spl);
+	}
+
+	state = get_page_state_by_value(value);
+
+	if (state == PAGE_FREE) {
+		return;
+	} else if (state == PAGE_IN_SWP) {
+		swapfile_release((value & PAGE_FRAME) >> ADDR_LOW_SHIFT, 1);
+	} else {
+		pt_dropframe((paddr_t) (value & PAGE_FRAME), as);
+	}
+
+	set_value(spt, offset, PAGE_FREE_MASK);
+}
+
+int pt_set_busy(struct pagetable *pt, vaddr_t vaddr) {
+	int offset, value;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 1, 0, &spt);
+	if (spt == NULL) {
+		return ENOMEM;
+	}
+
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	value = get_value(spt, offset);
+	assert(get_page_state_by_value(value) != PAGE_IN_MEM);
+	assert(!(value & PAGE_BUSY_MASK));
+
+	set_value(spt, offset, value | PAGE_BUSY_MASK);
+
+	return 0;
+}
+
+
+void pt_clear_busy(struct pagetable *pt, vaddr_t vaddr) {
+	int offset, spl;
+	struct pagetable *spt;
+
+	spl = splhigh();
+
+	// filling in the page usually clears the flag already
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt != NULL) {
+		offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+		set_value(spt, offset, get_value(spt, offset) & ~PAGE_BUSY_MASK);
+	}
+
+	thread_wakeup(&busy_channel);
+
+	splx(spl);
+}
+
+
+int pt_is_busy(struct pagetable *pt, vaddr_t vaddr) {
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt == NULL) {
+		return 0;
+	}
+
+	return get_value(spt, get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT)) & PAGE_BUSY_MASK;
+}
+
+
+void pt_wait_busy() {
+	assert(curspl == SPL_HIGH);
+
+	// everyone waits on the same channel since pages are rarely busy,
+	// so waking up doesn't mean the page we want is done
+	thread_sleep(&busy_channel);
+}
+
+
+void pt_notify_of_move(struct pagetable *pt, vaddr_t vaddr, paddr_t paddr) {
+	int offset, value;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt == NULL) {
+		return;
+	}
+
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	value = get_value(spt, offset);
+	assert(get_page_state_by_value(value) == PAGE_IN_MEM);
+
+	set_value(spt, offset, (int) (paddr & PAGE_FRAME) | (value & ~PAGE_FRAME));
+}
+
+
 void pt_notify_of_swap(struct pagetable *pt, vaddr_t vaddr, int index) {
 	u_int32_t offset, value;
 	paddr_t paddr;
@@ -342,7 +644,7 @@ void pt_notify_of_swap(struct pagetable *pt, vaddr_t vaddr, int index) {
 			if (!value) {
 				value = get_value(spt, offset);
 				value = value & 0xFFF;
-				value = value & ~(PAGE_FREE | PAGE_IN_MEM);
+				value = value & ~(PAGE_FREE | PAGE_IN_MEM | PAGE_DIRTY_MASK);
 				value |= PAGE_IN_SWP;
 				set_value(spt, offset, value | (index << ADDR_LOW_SHIFT));
 				return;
@@ -363,3 +665,21 @@ void pt_notify_of_swap(struct pagetable *pt, vaddr_t vaddr, int index) {
 		panic("STOP BEING A RETARD AND SET THE FLAGS PROPER.");
 	}
 }
+
+void pt_notify_of_discard(struct pagetable *pt, vaddr_t vaddr) {
+	int offset, value;
+	struct pagetable *spt;
+
+	get_pagetable(pt, vaddr, 0, 0, &spt);
+	if (spt == NULL) {
+		return;
+	}
+
+	offset = get_offset(vaddr, ADDR_LOW_MASK, ADDR_LOW_SHIFT);
+	value = get_value(spt, offset);
+	assert(get_page_state_by_value(value) == PAGE_IN_MEM);
+	assert(!(value & PAGE_DIRTY_MASK));
+
+	// only the permissions are kept, like any entry that was never used
+	set_value(spt, offset, PAGE_FREE_MASK | (value & (PAGE_R_MASK | PAGE_W_MASK | PAGE_X_MASK)));
+}
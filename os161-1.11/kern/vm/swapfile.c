@@ -1,30 +1,61 @@
 #include <swapfile.h>
 
 #include <addrspace.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <lib.h>
 #include <synch.h>
 #include <uio.h>
 #include <uw-vmstats.h>
 #include <vfs.h>
+#include <vmalloc.h>
 #include <vnode.h>
+#include <zswap.h>
 
-static int swapfile_entries[SWAPFILE_MAX_PAGES];
+// one bit per swapfile page, set if the page is in use
+#define SWAPFILE_WORDS ((SWAPFILE_MAX_PAGES + 31) / 32)
+static u_int32_t swapfile_bitmap[SWAPFILE_WORDS];
+// the number of references to each page in use past the first, since a
+// shared page is swapped out of every page table that has it
+static unsigned char swapfile_shares[SWAPFILE_MAX_PAGES];
 
 static struct vnode *swapfile;
 
+// the number of pages the swap device can hold, at most SWAPFILE_MAX_PAGES
+static int swapfile_npages = SWAPFILE_MAX_PAGES;
+
 static struct lock *swapfile_lock;
 
-// the number of used entries in the swapfile (for debugging purposes)
+// the number of used entries in the swapfile
 static unsigned int swapfile_pages_in_use = 0;
 
-// used to search the swapfile circularly for an empty page
-static int last_page_stored = 0;
+// the word of the bitmap to start searching for an empty page from
+static unsigned int swapfile_hint = 0;
+
+// a buffer for gathering pages that are written out together
+static char *swapfile_cluster;
+
+#if ZSWAP_ENABLED
+// a page spilled from the compressed pool on its way to the swapfile
+static char *swapfile_spill;
+#endif
+
+// pages read ahead of the one that was asked for, which are swapfile pages
+// readahead_index to readahead_index + readahead_count - 1
+static char *swapfile_readahead;
+static int readahead_index = 0;
+static int readahead_count = 0;
 
 void swapfile_bootstrap() {
 	int i;
-	for (i = 0; i < SWAPFILE_MAX_PAGES; i++) {
-		swapfile_entries[i] = 0;
+	for (i = 0; i < SWAPFILE_WORDS; i++) {
+		swapfile_bitmap[i] = 0;
+	}
+
+	// mark the bits past the end of the swapfile as used
+	for (i = swapfile_npages; i < SWAPFILE_WORDS * 32; i++) {
+		swapfile_bitmap[i / 32] |= 1U << (i % 32);
 	}
 
 	DEBUG(DB_SWAPFILE, "Opening swapfile %s of size %d (%d pages).\n", SWAPFILE_NAME, SWAPFILE_MAX_SIZE, SWAPFILE_MAX_PAGES);
@@ -36,6 +67,77 @@ void swapfile_bootstrap() {
 
 	swapfile_lock = lock_create("swapfile_lock");
 	if (swapfile_lock == NULL) panic("Unable to instantiate swapfile_lock.\n");
+
+	swapfile_cluster = vmalloc(SWAPFILE_CLUSTER_PAGES * PAGE_SIZE);
+	swapfile_readahead = vmalloc(SWAPFILE_CLUSTER_PAGES * PAGE_SIZE);
+	if (swapfile_cluster == NULL || swapfile_readahead == NULL) panic("Unable to allocate swapfile buffers.\n");
+
+#if ZSWAP_ENABLED
+	swapfile_spill = kmalloc(PAGE_SIZE);
+	if (swapfile_spill == NULL) panic("Unable to allocate swapfile buffers.\n");
+
+	zswap_bootstrap();
+#endif
+}
+
+int swapfile_setdevice(const char *name) {
+	struct vnode *device;
+	struct stat info;
+	int err, i;
+
+	char *device_name = kstrdup(name); // copy the name because vfs_open does funny things with it
+	if (device_name == NULL) {
+		return ENOMEM;
+	}
+
+	// raw devices can't be created or truncated
+	err = vfs_open(device_name, O_RDWR, &device);
+	kfree(device_name);
+	if (err != 0) {
+		return err;
+	}
+
+	err = VOP_STAT(device, &info);
+	if (err == 0 && info.st_size < PAGE_SIZE) {
+		// not a disk, or one too small to hold even a page
+		err = EINVAL;
+	}
+	if (err != 0) {
+		vfs_close(device);
+		return err;
+	}
+
+	lock_acquire(swapfile_lock);
+
+	// pages that are already swapped out would be lost
+	if (swapfile_pages_in_use != 0) {
+		lock_release(swapfile_lock);
+		vfs_close(device);
+		return EBUSY;
+	}
+
+	// nothing is swapped out to the old swapfile, so it can be let go
+	vfs_close(swapfile);
+	swapfile = device;
+	swapfile_npages = info.st_size / PAGE_SIZE;
+	if (swapfile_npages > SWAPFILE_MAX_PAGES) {
+		swapfile_npages = SWAPFILE_MAX_PAGES;
+	}
+
+	for (i = 0; i < SWAPFILE_WORDS; i++) {
+		swapfile_bitmap[i] = 0;
+	}
+	for (i = swapfile_npages; i < SWAPFILE_WORDS * 32; i++) {
+		swapfile_bitmap[i / 32] |= 1U << (i % 32);
+	}
+	swapfile_hint = 0;
+	readahead_count = 0;
+
+	DEBUG(DB_SWAPFILE, "Swapping to device %s of %d pages.\n", name, swapfile_npages);
+
+	lock_release(swapfile_lock);
+
+	return 0;
 }
 
 void swapfile_shutdown() {
@@ -44,27 +146,81 @@ void swapfile_shutdown() {
 	// The virtual file system has already cleaned up so this causes a panic
 //	vfs_close(swapfile);
 
+	vfree(swapfile_cluster);
+	vfree(swapfile_readahead);
+#if ZSWAP_ENABLED
+	kfree(swapfile_spill);
+#endif
+
 	lock_destroy(swapfile_lock);
 }
 
-/** Utility method to get a free page in the swapfile. **/
-static int swapfile_getfreepage() {
+/** Utility method to get the index of the lowest zero bit of a word that
+ * isn't all ones. **/
+static int swapfile_firstzero(u_int32_t word) {
+	int bit = 0;
+	word = ~word;
+
+	if ((word & 0xFFFF) == 0) { word >>= 16; bit += 16; }
+	if ((word & 0xFF) == 0) { word >>= 8; bit += 8; }
+	if ((word & 0xF) == 0) { word >>= 4; bit += 4; }
+	if ((word & 0x3) == 0) { word >>= 2; bit += 2; }
+	if ((word & 0x1) == 0) { bit += 1; }
+
+	return bit;
+}
+
+static int swapfile_isused(int page) {
+	return (swapfile_bitmap[page / 32] >> (page % 32)) & 1;
+}
+
+static void swapfile_mark(int page, int npages) {
+	int i;
+	for (i = page; i < page + npages; i++) {
+		assert(!swapfile_isused(i));
+		swapfile_bitmap[i / 32] |= 1U << (i % 32);
+	}
+	swapfile_pages_in_use += npages;
+}
+
+static void swapfile_unmark(int page, int npages) {
 	int i;
-	for (i = last_page_stored; i != last_page_stored - 1; i = (i + 1) % SWAPFILE_MAX_PAGES) {
-		if (swapfile_entries[i] == 0) {
-			last_page_stored = i;
+	for (i = page; i < page + npages; i++) {
+		assert(swapfile_isused(i));
+		swapfile_bitmap[i / 32] &= ~(1U << (i % 32));
+	}
+	swapfile_pages_in_use -= npages;
+}
+
+/** Utility method to get a free page in the swapfile. Must be called with
+ * the swapfile lock held. **/
+static int swapfile_getfreepage() {
+	if (swapfile_pages_in_use == (unsigned int) swapfile_npages) {
+		return -1;
+	}
 
-			return i;
+	unsigned int i, word;
+	for (i = 0; i < SWAPFILE_WORDS; i++) {
+		word = (swapfile_hint + i) % SWAPFILE_WORDS;
+
+		if (swapfile_bitmap[word] != 0xFFFFFFFF) {
+			swapfile_hint = word;
+
+			return word * 32 + swapfile_firstzero(swapfile_bitmap[word]);
 		}
 	}
 
+	// the free count says there's a page somewhere
+	panic("Swapfile bitmap and free count disagree.\n");
 	return -1;
 }
 
 int swapfile_storepage(void *source) {
 	int index = swapfile_prepareswap();
 
-	swapfile_performkswap(index, source);
+	if (index != -1) {
+		swapfile_performkswap(index, source);
+	}
 
 	return index;
 }
@@ -74,43 +230,217 @@ int swapfile_prepareswap() {
 
 	int index = swapfile_getfreepage();
 
-	if (index == -1) {
-		panic("Out of swap space.");
+	if (index != -1) {
+		swapfile_mark(index, 1);
 	}
 
-	swapfile_entries[index] = 1;
+	lock_release(swapfile_lock);
 
-	swapfile_pages_in_use += 1;
+	return index;
+}
+
+int swapfile_reserve(int npages) {
+	assert(npages > 0);
+
+	lock_acquire(swapfile_lock);
+
+	if (swapfile_pages_in_use + npages > (unsigned int) swapfile_npages) {
+		lock_release(swapfile_lock);
+		return -1;
+	}
+
+	// look for a run of npages clear bits, skipping full words
+	int page = 0, run = 0;
+	while (page < swapfile_npages) {
+		if (run == 0 && page % 32 == 0 && swapfile_bitmap[page / 32] == 0xFFFFFFFF) {
+			page += 32;
+			continue;
+		}
+
+		if (swapfile_isused(page)) {
+			run = 0;
+		} else if (++run == npages) {
+			page -= npages - 1;
+			swapfile_mark(page, npages);
+
+			lock_release(swapfile_lock);
+			return page;
+		}
+
+		page += 1;
+	}
 
 	lock_release(swapfile_lock);
+	return -1;
+}
 
-	return index;
+void swapfile_release(int index, int npages) {
+	assert(index >= 0);
+	assert(index + npages <= swapfile_npages);
+
+	lock_acquire(swapfile_lock);
+
+	int i;
+	for (i = index; i < index + npages; i++) {
+		if (swapfile_shares[i] > 0) {
+			swapfile_shares[i] -= 1;
+			continue;
+		}
+
+		swapfile_unmark(i, 1);
+#if ZSWAP_ENABLED
+		zswap_invalidate(i);
+#endif
+	}
+
+	// freed pages are a good place to look next time
+	if ((unsigned int) index / 32 < swapfile_hint) {
+		swapfile_hint = index / 32;
+	}
+
+	lock_release(swapfile_lock);
 }
 
-void swapfile_performkswap(int index, void *source) {
+void swapfile_share(int index) {
+	assert(index >= 0 && index < swapfile_npages);
+
 	lock_acquire(swapfile_lock);
 
-	DEBUG(DB_SWAPFILE, "Storing page at %x to swapfile page %d. %d of %d pages are in use.\n",
-			(unsigned int) source, index, swapfile_pages_in_use, SWAPFILE_MAX_PAGES);
+	assert(swapfile_isused(index));
+	assert(swapfile_shares[index] < 0xFF);
+	swapfile_shares[index] += 1;
 
-	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	lock_release(swapfile_lock);
+}
 
-	// construct a uio to handle the write
+unsigned int swapfile_getfreecount() {
+	return swapfile_npages - swapfile_pages_in_use;
+}
+
+/** Utility method to read or write npages pages of the swapfile starting
+ * at index with a single operation. Must be called with the swapfile lock
+ * held. **/
+static void swapfile_io(int index, void *buffer, int npages, enum uio_rw rw) {
+	// construct a uio to handle the operation
 	struct uio operation;
-	operation.uio_iovec.iov_kbase = source;
-	operation.uio_iovec.iov_len = PAGE_SIZE;
+	operation.uio_iovec.iov_kbase = buffer;
+	operation.uio_iovec.iov_len = npages * PAGE_SIZE;
 
 	operation.uio_offset = index * PAGE_SIZE;
-	operation.uio_resid = PAGE_SIZE;
+	operation.uio_resid = npages * PAGE_SIZE;
 	operation.uio_segflg = UIO_SYSSPACE;
-	operation.uio_rw = UIO_WRITE;
+	operation.uio_rw = rw;
 	operation.uio_space = NULL;
 
-	int err = VOP_WRITE(swapfile, &operation);
+	int err;
+	if (rw == UIO_WRITE) {
+		vmstats_inc(VMSTAT_SWAP_DEVICE_WRITE);
+		err = VOP_WRITE(swapfile, &operation);
+	} else {
+		vmstats_inc(VMSTAT_SWAP_DEVICE_READ);
+		err = VOP_READ(swapfile, &operation);
+	}
 	int length = operation.uio_offset - index * PAGE_SIZE;
 
 	assert(err == 0);
-	assert(length == PAGE_SIZE);
+	assert(length == npages * PAGE_SIZE);
+}
+
+/** Utility method to forget read ahead pages that are being overwritten. **/
+static void swapfile_invalidatereadahead(int index, int npages) {
+	if (index < readahead_index + readahead_count && readahead_index < index + npages) {
+		readahead_count = 0;
+	}
+}
+
+#if ZSWAP_ENABLED
+/** Utility method to keep a page in the compressed pool instead of writing
+ * it, spilling the oldest pages in the pool to the swapfile to make room if
+ * needed. Returns nonzero if the page was kept, or zero if it has to be
+ * written out after all. Must be called with the swapfile lock held. **/
+static int swapfile_compress(int index, void *source) {
+	int result = zswap_store(index, source);
+
+	while (result == ENOSPC) {
+		int spilled = zswap_spill(swapfile_spill);
+		if (spilled == -1) {
+			break;
+		}
+
+		swapfile_invalidatereadahead(spilled, 1);
+		swapfile_io(spilled, swapfile_spill, 1, UIO_WRITE);
+
+		result = zswap_store(index, source);
+	}
+
+	if (result != 0) {
+		return 0;
+	}
+
+	// the copy in the swapfile itself, if any, is out of date
+	swapfile_invalidatereadahead(index, 1);
+	return 1;
+}
+#endif
+
+void swapfile_performkswap(int index, void *source) {
+	lock_acquire(swapfile_lock);
+
+	DEBUG(DB_SWAPFILE, "Storing page at %x to swapfile page %d. %d of %d pages are in use.\n",
+			(unsigned int) source, index, swapfile_pages_in_use, swapfile_npages);
+
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+
+#if ZSWAP_ENABLED
+	if (swapfile_compress(index, source)) {
+		lock_release(swapfile_lock);
+		return;
+	}
+#endif
+
+	swapfile_invalidatereadahead(index, 1);
+	swapfile_io(index, source, 1, UIO_WRITE);
+
+	lock_release(swapfile_lock);
+}
+
+void swapfile_performkswapcluster(int index, void **sources, int npages) {
+	assert(npages > 0 && npages <= SWAPFILE_CLUSTER_PAGES);
+
+	if (npages == 1) {
+		swapfile_performkswap(index, sources[0]);
+		return;
+	}
+
+	lock_acquire(swapfile_lock);
+
+	DEBUG(DB_SWAPFILE, "Storing %d pages to swapfile pages %d to %d. %d of %d pages are in use.\n",
+			npages, index, index + npages - 1, swapfile_pages_in_use, swapfile_npages);
+
+	// gather the pages so they can go out in one write. Pages kept in the
+	// compressed pool split the cluster into runs written separately.
+	int i, first = 0;
+	for (i = 0; i < npages; i++) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+
+#if ZSWAP_ENABLED
+		if (swapfile_compress(index + i, sources[i])) {
+			if (i > first) {
+				swapfile_invalidatereadahead(index + first, i - first);
+				swapfile_io(index + first, swapfile_cluster, i - first, UIO_WRITE);
+			}
+			first = i + 1;
+			continue;
+		}
+#endif
+
+		memmove(swapfile_cluster + (i - first) * PAGE_SIZE, sources[i], PAGE_SIZE);
+	}
+
+	if (npages > first) {
+		swapfile_invalidatereadahead(index + first, npages - first);
+		swapfile_io(index + first, swapfile_cluster, npages - first, UIO_WRITE);
+	}
 
 	lock_release(swapfile_lock);
 }
@@ -119,7 +449,7 @@ void swapfile_performswap(int index, struct addrspace *addrspace, vaddr_t vaddr)
 	lock_acquire(swapfile_lock);
 
 	DEBUG(DB_SWAPFILE, "Storing page at %x in address space %s to swapfile page %d. %d of %d pages are in use.\n",
-			(unsigned int) vaddr, (unsigned int) addrspace, index, swapfile_pages_in_use, SWAPFILE_MAX_PAGES);
+			(unsigned int) vaddr, (unsigned int) addrspace, index, swapfile_pages_in_use, swapfile_npages);
 
 	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
 
@@ -134,6 +464,12 @@ void swapfile_performswap(int index, struct addrspace *addrspace, vaddr_t vaddr)
 	operation.uio_rw = UIO_WRITE;
 	operation.uio_space = addrspace;
 
+	vmstats_inc(VMSTAT_SWAP_DEVICE_WRITE);
+	swapfile_invalidatereadahead(index, 1);
+#if ZSWAP_ENABLED
+	zswap_invalidate(index);
+#endif
+
 	int err = VOP_WRITE(swapfile, &operation);
 	int length = operation.uio_offset - index * PAGE_SIZE;
 
@@ -143,33 +479,59 @@ void swapfile_performswap(int index, struct addrspace *addrspace, vaddr_t vaddr)
 	lock_release(swapfile_lock);
 }
 
-int swapfile_getpage(int page, void *dest) {
+int swapfile_readpage(int page, void *dest) {
 	lock_acquire(swapfile_lock);
 
 	assert(page >= 0);
-	assert(page < SWAPFILE_MAX_PAGES);
-	assert(swapfile_entries[page] == 1);
+	assert(page < swapfile_npages);
+	assert(swapfile_isused(page));
 
-	// construct a uio to handle the write
-	struct uio operation;
-	operation.uio_iovec.iov_kbase = dest;
-	operation.uio_iovec.iov_len = PAGE_SIZE;
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
 
-	operation.uio_offset = page * PAGE_SIZE;
-	operation.uio_resid = PAGE_SIZE;
-	operation.uio_segflg = UIO_SYSSPACE;
-	operation.uio_rw = UIO_READ;
-	operation.uio_space = NULL;
+#if ZSWAP_ENABLED
+	// pages in the compressed pool never need the disk
+	if (zswap_load(page, dest)) {
+		vmstats_inc(VMSTAT_ZSWAP_HIT);
+		lock_release(swapfile_lock);
+		return page;
+	}
+	vmstats_inc(VMSTAT_ZSWAP_MISS);
+#endif
+
+	if (page >= readahead_index && page < readahead_index + readahead_count) {
+		// we already read this page along with an earlier one
+		vmstats_inc(VMSTAT_SWAP_READAHEAD_HIT);
+	} else {
+		// pages that were swapped out together are likely to be wanted
+		// together, so read the rest of the run with this one, up to a
+		// page that never made it to the disk
+		int npages = 1;
+		while (npages < SWAPFILE_CLUSTER_PAGES && page + npages < swapfile_npages &&
+				swapfile_isused(page + npages)) {
+#if ZSWAP_ENABLED
+			if (zswap_contains(page + npages)) {
+				break;
+			}
+#endif
+			npages += 1;
+		}
 
-	int err = VOP_READ(swapfile, &operation);
-	int length = operation.uio_offset - page * PAGE_SIZE;
+		swapfile_io(page, swapfile_readahead, npages, UIO_READ);
 
-	assert(err == 0);
-	assert(length == PAGE_SIZE);
+		readahead_index = page;
+		readahead_count = npages;
+	}
 
-	swapfile_entries[page] = 0;
+	memmove(dest, swapfile_readahead + (page - readahead_index) * PAGE_SIZE, PAGE_SIZE);
 
 	lock_release(swapfile_lock);
 
 	return page;
 }
+
+int swapfile_getpage(int page, void *dest) {
+	swapfile_readpage(page, dest);
+	swapfile_release(page, 1);
+
+	return page;
+}
@@ -0,0 +1,227 @@
+#include <textcache.h>
+
+#include <coremap.h>
+#include <lib.h>
+#include <synch.h>
+#include <uw-vmstats.h>
+#include <vm.h>
+#include <vnode.h>
+
+// A cached text page of an executable. The page is found by the vnode of
+// the executable and the virtual address the page is loaded at, which is
+// the same for every process running the same binary.
+struct textcache_entry {
+	// the executable or NULL if the entry is unused
+	struct vnode *vn;
+	vaddr_t vaddr;
+	paddr_t paddr;
+
+	// the next entry in the same hash chain or free list or -1
+	int next;
+};
+
+// entries come from a fixed pool so that nothing is allocated while
+// the cache is reclaiming pages to satisfy an allocation
+static struct textcache_entry entries[TEXTCACHE_MAX_PAGES];
+
+// the first entry of each hash chain and of the unused entries or -1
+static int buckets[TEXTCACHE_BUCKETS];
+static int free_entries;
+
+// the number of pages in the cache
+static unsigned int textcache_pages = 0;
+
+// the next entry reclaiming will look at
+static unsigned int reclaim_hand = 0;
+
+// a lock used while accessing the cache
+static struct lock *textcache_lock;
+
+void textcache_bootstrap() {
+	int i;
+
+	for (i = 0; i < TEXTCACHE_BUCKETS; i++) {
+		buckets[i] = -1;
+	}
+
+	for (i = 0; i < TEXTCACHE_MAX_PAGES; i++) {
+		entries[i].vn = NULL;
+		entries[i].next = (i + 1 < TEXTCACHE_MAX_PAGES ? i + 1 : -1);
+	}
+	free_entries = 0;
+
+	textcache_lock = lock_create("textcache_lock");
+	if (textcache_lock == NULL) panic("Unable to instantiate textcache_lock.\n");
+}
+
+static int textcache_hash(struct vnode *vn, vaddr_t vaddr) {
+	return (((u_int32_t) vn >> 4) ^ (vaddr >> 12)) % TEXTCACHE_BUCKETS;
+}
+
+/** Returns the index of the entry for the page or -1 if it isn't cached.
+ * The lock must be held. **/
+static int textcache_find(struct vnode *vn, vaddr_t vaddr) {
+	int i;
+
+	vaddr &= PAGE_FRAME;
+
+	for (i = buckets[textcache_hash(vn, vaddr)]; i != -1; i = entries[i].next) {
+		if (entries[i].vn == vn && entries[i].vaddr == vaddr) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/** Takes an entry out of its hash chain and drops the references it held.
+ * The lock must be held. **/
+static void textcache_remove(int idx) {
+	int *link = &buckets[textcache_hash(entries[idx].vn, entries[idx].vaddr)];
+	struct vnode *vn = entries[idx].vn;
+
+	while (*link != idx) {
+		assert(*link != -1);
+		link = &entries[*link].next;
+	}
+	*link = entries[idx].next;
+
+	coremap_freepages(entries[idx].paddr);
+
+	entries[idx].vn = NULL;
+	entries[idx].next = free_entries;
+	free_entries = idx;
+
+	textcache_pages -= 1;
+
+	DEBUG(DB_VM, "Text cache dropped page 0x%x (%u cached).\n", entries[idx].vaddr, textcache_pages);
+
+	VOP_DECREF(vn);
+}
+
+paddr_t textcache_get(struct vnode *vn, vaddr_t vaddr) {
+	paddr_t paddr = (paddr_t) NULL;
+
+	lock_acquire(textcache_lock);
+
+	int idx = textcache_find(vn, vaddr);
+	if (idx != -1) {
+		paddr = entries[idx].paddr;
+		coremap_sharepage(paddr);
+		coremap_setpagereferenced(paddr);
+	}
+
+	lock_release(textcache_lock);
+
+	return paddr;
+}
+
+int textcache_contains(struct vnode *vn, vaddr_t vaddr) {
+	int found;
+
+	lock_acquire(textcache_lock);
+	found = (textcache_find(vn, vaddr) != -1);
+	lock_release(textcache_lock);
+
+	return found;
+}
+
+void textcache_insert(struct vnode *vn, vaddr_t vaddr, paddr_t paddr) {
+	lock_acquire(textcache_lock);
+
+	vaddr &= PAGE_FRAME;
+	paddr &= PAGE_FRAME;
+
+	if (textcache_find(vn, vaddr) != -1 || free_entries == -1) {
+		lock_release(textcache_lock);
+		return;
+	}
+
+	int idx = free_entries;
+	free_entries = entries[idx].next;
+
+	int bucket = textcache_hash(vn, vaddr);
+	entries[idx].vn = vn;
+	entries[idx].vaddr = vaddr;
+	entries[idx].paddr = paddr;
+	entries[idx].next = buckets[bucket];
+	buckets[bucket] = idx;
+
+	textcache_pages += 1;
+
+	// The cache's reference isn't a mapping the coremap can swap the page
+	// out of, so the page stays in memory for as long as it is cached
+	VOP_INCREF(vn);
+	coremap_sharepage(paddr);
+
+	DEBUG(DB_VM, "Text cache added page 0x%x (%u cached).\n", vaddr, textcache_pages);
+
+	lock_release(textcache_lock);
+}
+
+void textcache_invalidate(struct vnode *vn) {
+	int i;
+
+	// writes to the console and other files are far more common than
+	// writes to programs, so don't search an empty cache for them
+	if (textcache_lock == NULL || textcache_pages == 0) {
+		return;
+	}
+
+	lock_acquire(textcache_lock);
+
+	for (i = 0; i < TEXTCACHE_MAX_PAGES; i++) {
+		if (entries[i].vn == vn) {
+			textcache_remove(i);
+		}
+	}
+
+	lock_release(textcache_lock);
+}
+
+int textcache_reclaim(int maxpages) {
+	unsigned int i;
+	int freed = 0;
+
+	// we may be asked for memory before the cache exists or by
+	// something the cache itself is doing
+	if (textcache_lock == NULL || lock_do_i_hold(textcache_lock)) {
+		return 0;
+	}
+
+	lock_acquire(textcache_lock);
+
+	for (i = 0; i < TEXTCACHE_MAX_PAGES && freed < maxpages; i++) {
+		int idx = reclaim_hand;
+		reclaim_hand = (reclaim_hand + 1) % TEXTCACHE_MAX_PAGES;
+
+		// only the cache's own reference is left so nobody is using it
+		if (entries[idx].vn != NULL && coremap_getrefcount(entries[idx].paddr) == 1) {
+			textcache_remove(idx);
+			vmstats_inc(VMSTAT_TEXTCACHE_RECLAIM);
+			freed += 1;
+		}
+	}
+
+	lock_release(textcache_lock);
+
+	return freed;
+}
+
+void textcache_flush() {
+	int i;
+
+	if (textcache_lock == NULL) {
+		return;
+	}
+
+	lock_acquire(textcache_lock);
+
+	for (i = 0; i < TEXTCACHE_MAX_PAGES; i++) {
+		if (entries[i].vn != NULL) {
+			textcache_remove(i);
+		}
+	}
+
+	lock_release(textcache_lock);
+}
@@ -0,0 +1,153 @@
+#include <tlbreplace.h>
+
+#include <kern/errno.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <machine/tlb.h>
+#include <uw-vmstats.h>
+
+// Slots written through here are tracked so invalid ones can be found
+// without reading the TLB. The refill code in exception.S also writes
+// entries, to slots it doesn't tell us about, so a slot believed to be
+// invalid may hold an entry. Replacing it is a poor choice but not a
+// wrong one since the new entry just missed and so can't be a duplicate.
+static int slot_valid[NUM_TLB];
+
+// nonzero for slots holding an entry that was refaulted soon after being
+// replaced, which the second chance policy passes over once
+static int slot_hot[NUM_TLB];
+
+// the next slot the round-robin and second chance policies look at
+static int hand = TLBREPLACE_WIRED;
+
+// entries that were recently replaced, oldest first to be overwritten
+static u_int32_t history[TLBREPLACE_HISTORY];
+static int history_next = 0;
+
+static int policy = TLBREPLACE_DEFAULT;
+
+static int choose_invalid() {
+	int i;
+
+	for (i = TLBREPLACE_WIRED; i < NUM_TLB; i++) {
+		if (!slot_valid[i]) {
+			return i;
+		}
+	}
+
+	i = hand;
+	hand = (hand + 1) % NUM_TLB;
+	if (hand == 0) {
+		hand = TLBREPLACE_WIRED;
+	}
+	return i;
+}
+
+static int choose_random() {
+	return TLBREPLACE_WIRED + random() % (NUM_TLB - TLBREPLACE_WIRED);
+}
+
+static int choose_plru() {
+	int i;
+
+	for (i = TLBREPLACE_WIRED; i < NUM_TLB; i++) {
+		if (!slot_valid[i]) {
+			return i;
+		}
+	}
+
+	// every slot is hot at most once, so two sweeps find one
+	for (i = 0; i < 2 * NUM_TLB; i++) {
+		int idx = hand;
+		hand = (hand + 1) % NUM_TLB;
+		if (hand == 0) {
+			hand = TLBREPLACE_WIRED;
+		}
+
+		if (!slot_hot[idx]) {
+			return idx;
+		}
+		slot_hot[idx] = 0;
+	}
+
+	return hand;
+}
+
+static const struct {
+	const char *name;
+	int (*choose)(void);
+} policies[TLBREPLACE_COUNT] = {
+	{ "invalid",	choose_invalid },
+	{ "random",		choose_random },
+	{ "plru",		choose_plru },
+};
+
+int tlbreplace_choose() {
+	assert(curspl > 0);
+
+	return policies[policy].choose();
+}
+
+void tlbreplace_evicted(u_int32_t entryhi) {
+	history[history_next] = entryhi & (TLBHI_VPAGE | TLBHI_PID);
+	history_next = (history_next + 1) % TLBREPLACE_HISTORY;
+}
+
+void tlbreplace_filled(int idx, u_int32_t entryhi) {
+	int i;
+
+	slot_valid[idx] = 1;
+	slot_hot[idx] = 0;
+
+	entryhi &= TLBHI_VPAGE | TLBHI_PID;
+	for (i = 0; i < TLBREPLACE_HISTORY; i++) {
+		if (history[i] == entryhi) {
+			// the entry was thrown out too early
+			_vmstats_inc(VMSTAT_TLB_REFAULT);
+
+			slot_hot[idx] = 1;
+			history[i] = 0;
+			break;
+		}
+	}
+}
+
+void tlbreplace_invalidated(int idx) {
+	slot_valid[idx] = 0;
+	slot_hot[idx] = 0;
+}
+
+void tlbreplace_flushed() {
+	int i;
+
+	for (i = 0; i < NUM_TLB; i++) {
+		slot_valid[i] = 0;
+		slot_hot[i] = 0;
+	}
+
+	// flushing isn't a replacement decision, so nothing from before it
+	// counts as a refault
+	for (i = 0; i < TLBREPLACE_HISTORY; i++) {
+		history[i] = 0;
+	}
+}
+
+int tlbreplace_setpolicy(const char *name) {
+	int i;
+
+	for (i = 0; i < TLBREPLACE_COUNT; i++) {
+		if (!strcmp(name, policies[i].name)) {
+			int spl = splhigh();
+			policy = i;
+			splx(spl);
+
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+const char *tlbreplace_getpolicy() {
+	return policies[policy].name;
+}
@@ -33,11 +33,45 @@ static const char *stats_names[] = {
  /*  2 */ "TLB Faults with Replace",
  /*  3 */ "TLB Invalidations",
  /*  4 */ "TLB Reloads",
- /*  5 */ "Page Faults (Zeroed)",
- /*  6 */ "Page Faults (Disk)",
- /*  7 */ "Page Faults from ELF",
- /*  8 */ "Page Faults from Swapfile",
- /*  9 */ "Swapfile Writes",
+ /*  5 */ "Page Faults (Zeroed, Read)",
+ /*  6 */ "Page Faults (Zeroed, Write)",
+ /*  7 */ "Page Faults (Disk)",
+ /*  8 */ "Page Faults from ELF",
+ /*  9 */ "Page Faults from Swapfile",
+ /* 10 */ "Swapfile Writes",
+ /* 11 */ "Pageout Wakeups",
+ /* 12 */ "Pageout Evictions",
+ /* 13 */ "Pageout Low Watermark",
+ /* 14 */ "Pageout High Watermark",
+ /* 15 */ "Swapfile Device Writes",
+ /* 16 */ "Swapfile Device Reads",
+ /* 17 */ "Swapfile Read-ahead Hits",
+ /* 18 */ "ELF Pages Prefetched",
+ /* 19 */ "ELF Prefetch Hits",
+ /* 20 */ "Page Faults (Text Cache)",
+ /* 21 */ "Text Cache Reclaims",
+ /* 22 */ "Zeroed Pages from Pool",
+ /* 23 */ "Zeroed Pages not in Pool",
+ /* 24 */ "Pages Zeroed while Idle",
+ /* 25 */ "TLB Reloads by Refill Code",
+ /* 26 */ "TLB Refaults",
+ /* 27 */ "Pages Dirtied",
+ /* 28 */ "Clean Pages Discarded",
+ /* 29 */ "Swap Cache Hits",
+ /* 30 */ "Swap Cache Drops",
+ /* 31 */ "Compressed Swap Pages Stored",
+ /* 32 */ "Compressed Swap Same-filled Pages",
+ /* 33 */ "Compressed Swap Rejects",
+ /* 34 */ "Compressed Swap Hits",
+ /* 35 */ "Compressed Swap Misses",
+ /* 36 */ "Compressed Swap Spills",
+ /* 37 */ "Compressed Swap Size (% of page)",
+ /* 38 */ "Resident Set Allowance Grows",
+ /* 39 */ "Resident Set Allowance Shrinks",
+ /* 40 */ "Compactions",
+ /* 41 */ "Compaction Page Moves",
+ /* 42 */ "Fewest Free Pages",
+ /* 43 */ "Zero Page Write Copies",
 };
 
 
@@ -60,6 +94,22 @@ vmstats_inc(unsigned int index)
   }
 }
 
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_set(unsigned int index, unsigned int value)
+{
+  if (curspl == SPL_HIGH) {
+    _vmstats_set(index, value);
+  } else {
+    /* simple check that vmstat_init has been called */
+    assert(stats_lock);
+    lock_acquire(stats_lock);
+      _vmstats_set(index, value);
+    lock_release(stats_lock);
+  }
+}
+
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init()
@@ -94,6 +144,14 @@ _vmstats_inc(unsigned int index)
   stats_counts[index]++;
 }
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_set(unsigned int index, unsigned int value)
+{
+  assert(index < VMSTAT_COUNT);
+  stats_counts[index] = value;
+}
+
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init()
@@ -131,7 +189,9 @@ _vmstats_print()
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
+    stats_counts[VMSTAT_PAGE_FAULT_ZERO_READ] + stats_counts[VMSTAT_PAGE_FAULT_ZERO_WRITE] +
+    stats_counts[VMSTAT_TLB_RELOAD] +
+    stats_counts[VMSTAT_TEXTCACHE_HIT];
   elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
@@ -141,12 +201,18 @@ _vmstats_print()
       tlb_faults, free_plus_replace); 
   }
 
-  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) = %d\n", disk_plus_zeroed_plus_reload);
+  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Text Cache) = %d\n", disk_plus_zeroed_plus_reload);
   if (tlb_faults != disk_plus_zeroed_plus_reload) {
-    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n",
+    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Text Cache) (%d)\n",
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
+  if (stats_counts[VMSTAT_SWAP_DEVICE_WRITE] > 0) {
+    kprintf("VMSTAT Swapfile Writes per Device Write = %d.%02d\n",
+      stats_counts[VMSTAT_SWAP_FILE_WRITE] / stats_counts[VMSTAT_SWAP_DEVICE_WRITE],
+      (stats_counts[VMSTAT_SWAP_FILE_WRITE] * 100 / stats_counts[VMSTAT_SWAP_DEVICE_WRITE]) % 100);
+  }
+
   kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
@@ -7,29 +7,67 @@
 #include <lib.h>
 #include <machine/spl.h>
 #include <machine/tlb.h>
+#include <pageout.h>
 #include <swapfile.h>
 #include <thread.h>
 #include <types.h>
+#include <synch.h>
+#include <textcache.h>
+#include <tlbreplace.h>
+#include <uio.h>
 #include <uw-vmstats.h>
+#include <vmalloc.h>
+#include <vnode.h>
 #include <pt.h>
+#include <zswap.h>
 
 #include "opt-A3.h"
 
 #define DUMBVM_STACKPAGES    12
 
-static int next_tlb_idx = 0;
+// ASIDs are handed out in order and only become good for reuse after they
+// have all been used, when the generation goes up and the TLB is flushed.
+// ASID 0 is never handed out.
+static u_int32_t next_asid = 1;
+static u_int32_t asid_generation = 1;
 
-static int get_tlb_replace_idx() {
-	int idx = next_tlb_idx;
-	next_tlb_idx = (next_tlb_idx + 1) % NUM_TLB;
-	return idx;
-}
+// the ASID of the address space that is active
+static u_int32_t current_asid = 0;
+
+// the wired TLB slot holding the kernel stack of the running thread, if
+// it is one from vmalloc
+static int wired_slot = 0;
+
+// the top-level page table the UTLB refill code in exception.S walks,
+// and the number of misses it dealt with without calling vm_fault
+struct pagetable *utlb_pagetable = NULL;
+u_int32_t utlb_fastrefills = 0;
+
+// the number of TLB misses vm_fault has dealt with, which along with
+// utlb_fastrefills keeps time for page-fault-frequency control
+static u_int32_t vm_faults = 0;
+
+// the number of pages of a region loaded together on a fault
+static int faultaround_pages = VM_FAULTAROUND_DEFAULT;
+
+// Buffers the pages are read into. Each load takes one of its own, so
+// faults on different executables don't wait on each other's reads, and
+// gives it back for the next load once it is done.
+static char *faultaround_buffers[VM_FAULTAROUND_BUFFERS];
+static int faultaround_nbuffers = 0;
 
 void vm_bootstrap() {
 	coremap_bootstrap();
+	pt_bootstrap();
 	swapfile_bootstrap();
 
 	vmstats_init();
+
+	textcache_bootstrap();
+
+#if SWAPPING_ENABLED
+	pageout_bootstrap();
+#endif
 }
 
 #if OPT_A3
@@ -37,30 +75,198 @@ void vm_shutdown() {
 	coremap_shutdown();
 	// swapfile_shutdown();
 
+	vmstats_set(VMSTAT_TLB_FAST_RELOAD, utlb_fastrefills);
+	vmstats_set(VMSTAT_ZSWAP_RATIO, zswap_getratio());
+	kprintf("TLB replacement policy: %s\n", tlbreplace_getpolicy());
+	kprintf("Page replacement policy: %s\n", coremap_getpolicy());
 	vmstats_print();
 }
 #endif
 
+void vm_tlb_flush() {
+	int i, spl;
+
+	spl = splhigh();
+
+	// the wired slots are global entries that no ASID change affects
+	for (i=TLBREPLACE_WIRED; i<NUM_TLB; i++) {
+		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	TLB_SetPID(current_asid);
+	tlbreplace_flushed();
+
+	// TLB has been entirely invalidated
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+/*
+ * Gives the address space an ASID of the current generation. Once they
+ * have all been handed out nothing in the TLB can be told apart anymore,
+ * so the TLB is flushed and every address space has to get a new one.
+ * Interrupts must be disabled.
+ */
+static void vm_newasid(struct addrspace *as) {
+	if (next_asid >= NUM_TLBPID) {
+		asid_generation += 1;
+		next_asid = 1;
+
+		vm_tlb_flush();
+	}
+
+	as->as_asid = next_asid++;
+	as->as_asidgen = asid_generation;
+}
+
+void vm_tlb_activate(struct addrspace *as) {
+	int spl = splhigh();
+
+	if (as->as_asidgen != asid_generation) {
+		vm_newasid(as);
+	}
+
+	current_asid = as->as_asid;
+	TLB_SetPID(current_asid);
+
+	utlb_pagetable = as->as_pt;
+
+	splx(spl);
+}
+
+void vm_tlb_deactivate(struct addrspace *as) {
+	int spl = splhigh();
+
+	if (utlb_pagetable == as->as_pt) {
+		utlb_pagetable = NULL;
+	}
+
+	splx(spl);
+}
+
+void vm_tlb_writeprotect(struct addrspace *as) {
+	u_int32_t ehi, elo;
+	int i, spl;
+
+	spl = splhigh();
+
+	// an address space without a current ASID has nothing in the TLB
+	if (as->as_asidgen == asid_generation) {
+		// the wired slots only ever hold kernel stacks
+		for (i = TLBREPLACE_WIRED; i < NUM_TLB; i++) {
+			TLB_Read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) && (elo & TLBLO_DIRTY) && !(elo & TLBLO_GLOBAL)
+					&& ((ehi & TLBHI_PID) >> TLBHI_PIDSHIFT) == as->as_asid) {
+				// the next write takes a TLB modify fault
+				TLB_Write(ehi, elo & ~TLBLO_DIRTY, i);
+			}
+		}
+		TLB_SetPID(current_asid);
+	}
+
+	splx(spl);
+}
+
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+	int i, spl;
+
+	spl = splhigh();
+
+	// an address space without a current ASID has nothing in the TLB
+	if (as->as_asidgen == asid_generation) {
+		i = TLB_Probe((vaddr & PAGE_FRAME) | (as->as_asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tlbreplace_invalidated(i);
+		}
+		TLB_SetPID(current_asid);
+	}
+
+	splx(spl);
+}
+
+void vm_tlb_invalidatekernel(vaddr_t vaddr) {
+	int i, spl;
+
+	spl = splhigh();
+
+	// kernel entries are global so they match whatever the ASID
+	i = TLB_Probe(vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		if (i >= TLBREPLACE_WIRED) {
+			tlbreplace_invalidated(i);
+		}
+	}
+	TLB_SetPID(current_asid);
+
+	splx(spl);
+}
+
+void vm_tlb_wirestack(vaddr_t stack) {
+	paddr_t paddr;
+	int i, spl;
+
+	// stacks in kseg0 need no TLB entry
+	if (stack < VMALLOC_BASE) {
+		return;
+	}
+
+	assert(STACK_SIZE == PAGE_SIZE);
+	paddr = vmalloc_getpaddr(stack);
+	assert(paddr != (paddr_t) NULL);
+
+	spl = splhigh();
+
+	i = TLB_Probe(stack, 0);
+	if (i >= 0 && i < TLBREPLACE_WIRED) {
+		wired_slot = i;
+	} else {
+		// an entry the stack got by faulting like any other kseg2 page
+		// would match along with the wired one
+		if (i >= 0) {
+			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tlbreplace_invalidated(i);
+		}
+
+		// the other slot holds the stack still being run on
+		wired_slot = (wired_slot + 1) % TLBREPLACE_WIRED;
+		TLB_Write(stack, paddr | TLBLO_VALID | TLBLO_DIRTY | TLBLO_GLOBAL, wired_slot);
+	}
+	TLB_SetPID(current_asid);
+
+	splx(spl);
+}
+
 static void tlb_update(vaddr_t faultaddress, paddr_t paddr, int tlb_idx) {
 	u_int32_t ehi, elo;
 	int writeable;
 
+#if SWAPPING_ENABLED
+	// writable pages stay read-only in the TLB until they are dirtied, so
+	// pageout knows which ones it can drop without writing them out
+	writeable = (paddr & PAGE_W_MASK) && (paddr & PAGE_DIRTY_MASK);
+#else
 	writeable = paddr & PAGE_W_MASK;
+#endif
 
 	paddr &= PAGE_FRAME;
 
-	ehi = faultaddress;
+	ehi = faultaddress | (current_asid << TLBHI_PIDSHIFT);
 	elo = paddr | TLBLO_VALID;
 	if (writeable) {
 		elo |= TLBLO_DIRTY;
 	}
+	if (faultaddress >= VMALLOC_BASE) {
+		elo |= TLBLO_GLOBAL;
+	}
 	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 	TLB_Write(ehi, elo, tlb_idx);
 }
 
 static int tlb_fault(vaddr_t faultaddress, paddr_t paddr) {
 	u_int32_t ehi, elo;
-	int tlb_idx = get_tlb_replace_idx();
+	int tlb_idx = tlbreplace_choose();
 
 	// Fault occured, but it was just a TLB Miss and not a bad address
 	vmstats_inc(VMSTAT_TLB_FAULT);
@@ -71,31 +277,305 @@ static int tlb_fault(vaddr_t faultaddress, paddr_t paddr) {
 		// Fault occurred and a TLB entry that is currently in use is
 		// being replaced with a new one.
 		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		tlbreplace_evicted(ehi);
 	} else {
 		// Fault occurred and we replaced an invalid TLB entry.
 		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 	}
 
 	tlb_update(faultaddress, paddr, tlb_idx);
+	tlbreplace_filled(tlb_idx, faultaddress | (current_asid << TLBHI_PIDSHIFT));
 	return tlb_idx;
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress) {
-	// TODO
+/*
+ * Records that the page at faultaddress has been written, both in the page
+ * table so its TLB entry can be made writable and in the coremap so it is
+ * saved rather than dropped if it is evicted. Returns the updated entry.
+ */
+static paddr_t vm_setdirty(struct pagetable *pt, vaddr_t faultaddress, paddr_t paddr) {
+	if (!(paddr & PAGE_DIRTY_MASK)) {
+		pt_set_flags(pt, faultaddress, PAGE_DIRTY_MASK);
+		coremap_setpagedirty(paddr & PAGE_FRAME);
+		vmstats_inc(VMSTAT_PAGE_DIRTIED);
+		paddr |= PAGE_DIRTY_MASK;
+	}
+
+	return paddr;
+}
+
+/*
+ * Page-fault-frequency control, called when the address space has to have a
+ * page brought into memory. If it faults again soon after its last fault it
+ * doesn't have enough pages to work with and is allowed more. If it has gone
+ * a long time without faulting it has more than it needs, and it's allowed
+ * fewer so that evicting pages starts with its pages.
+ */
+static void vm_pff(struct addrspace *as) {
+	u_int32_t now = utlb_fastrefills + vm_faults;
+	u_int32_t interval = now - as->as_lastfault;
+
+	as->as_lastfault = now;
+
+	if (interval < VM_PFF_HIGH) {
+		// there's no point growing it far past what it is using
+		if (as->as_allowance < as->as_resident + VM_PFF_STEP) {
+			as->as_allowance += VM_PFF_STEP;
+			vmstats_inc(VMSTAT_PFF_GROW);
+		}
+	} else if (interval > VM_PFF_LOW && as->as_allowance > VM_PFF_MIN) {
+		as->as_allowance -= VM_PFF_STEP;
+		if (as->as_allowance < VM_PFF_MIN) {
+			as->as_allowance = VM_PFF_MIN;
+		}
+		vmstats_inc(VMSTAT_PFF_SHRINK);
+	}
+
+	DEBUG(DB_VM, "Address space %p has %u pages and is allowed %u.\n", as, as->as_resident, as->as_allowance);
+}
+
+void vm_setfaultaround(int npages) {
+	if (npages < 1) {
+		npages = 1;
+	} else if (npages > VM_FAULTAROUND_MAX) {
+		npages = VM_FAULTAROUND_MAX;
+	}
+
+	faultaround_pages = npages;
+}
+
+/** Returns a buffer for a fault-around read, or NULL if there is no
+ * memory for one. **/
+static char *faultaround_getbuffer() {
+	char *buffer = NULL;
+	int spl = splhigh();
+
+	if (faultaround_nbuffers > 0) {
+		buffer = faultaround_buffers[--faultaround_nbuffers];
+	}
+
+	splx(spl);
+
+	if (buffer == NULL) {
+		buffer = vmalloc(VM_FAULTAROUND_MAX * PAGE_SIZE);
+	}
+	return buffer;
+}
+
+static void faultaround_putbuffer(char *buffer) {
+	int spl = splhigh();
+
+	if (faultaround_nbuffers < VM_FAULTAROUND_BUFFERS) {
+		faultaround_buffers[faultaround_nbuffers++] = buffer;
+		buffer = NULL;
+	}
+
+	splx(spl);
+
+	if (buffer != NULL) {
+		vfree(buffer);
+	}
+}
+
+/*
+ * Maps the text page at addr from the text cache if another process running
+ * the same binary has loaded it. Returns nonzero if it did.
+ */
+static int vm_maptext(struct addrspace *as, struct region *region, vaddr_t addr) {
+	paddr_t paddr = textcache_get(as->as_v, addr);
+	if (paddr == (paddr_t) NULL) {
+		return 0;
+	}
+
+	if (pt_map_page(as->as_pt, addr, paddr, region->permissions)) {
+		coremap_freepages(paddr);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Loads the page of the region at faultaddress from the ELF file, along with
+ * the not yet loaded pages around it in the same faultaround_pages aligned
+ * window of the region. The file part of all the pages is read with a single
+ * read and the rest is zero-filled. Pages other than the faulting one are
+ * flagged as prefetched so we can tell whether they get used.
+ *
+ * Text pages (executable but not writable) are the same in every process
+ * running the binary, so they are shared through the text cache rather than
+ * read again.
+ */
+static int vm_loadregion(struct addrspace *as, struct region *region, vaddr_t faultaddress) {
+	struct pagetable *pt = as->as_pt;
+	vaddr_t wbot, wtop, first, last, fbot, ftop, addr;
+	paddr_t paddr;
+	struct uio ku;
+	char *buffer;
+	int npages, i, result, text;
+
+	text = (region->permissions & PAGE_X_MASK) && !(region->permissions & PAGE_W_MASK);
+
+	// the window of pages to consider, clipped to the region
+	npages = faultaround_pages;
+	wbot = faultaddress - ((faultaddress / PAGE_SIZE) % npages) * PAGE_SIZE;
+	wtop = wbot + npages * PAGE_SIZE;
+	if (wbot < (region->vaddr & PAGE_FRAME)) {
+		wbot = region->vaddr & PAGE_FRAME;
+	}
+	if (wtop > region->vaddr + region->memsize) {
+		wtop = region->vaddr + region->memsize;
+	}
+	// pages past the end of the file are left for zero-fill faults
+	if (wtop > ((region->vaddr + region->filesize + PAGE_SIZE - 1) & PAGE_FRAME)) {
+		wtop = (region->vaddr + region->filesize + PAGE_SIZE - 1) & PAGE_FRAME;
+	}
+
+	if (text && vm_maptext(as, region, faultaddress)) {
+		// take whatever else of the window is cached while we're at it
+		for (addr = wbot; addr < wtop; addr += PAGE_SIZE) {
+			if (addr != faultaddress && (pt_get_paddr(pt, addr, 0, 0) & PAGE_FREE) &&
+					vm_maptext(as, region, addr)) {
+				pt_set_flags(pt, addr, PAGE_PREFETCH_MASK);
+				vmstats_inc(VMSTAT_ELF_PREFETCH);
+			}
+		}
+
+		vmstats_inc(VMSTAT_TEXTCACHE_HIT);
+
+		return 0;
+	}
+
+	// grow a run of unloaded pages out from the faulting one, but don't
+	// push other pages out of memory for pages nobody asked for, and leave
+	// cached text pages to be shared when they are used
+	first = last = faultaddress;
+	if (coremap_getfreecount() > (unsigned int) npages) {
+		while (first > wbot && (pt_get_paddr(pt, first - PAGE_SIZE, 0, 0) & PAGE_FREE) &&
+				!(text && textcache_contains(as->as_v, first - PAGE_SIZE))) {
+			first -= PAGE_SIZE;
+		}
+		while (last + PAGE_SIZE < wtop && (pt_get_paddr(pt, last + PAGE_SIZE, 0, 0) & PAGE_FREE) &&
+				!(text && textcache_contains(as->as_v, last + PAGE_SIZE))) {
+			last += PAGE_SIZE;
+		}
+	}
+	npages = (last - first) / PAGE_SIZE + 1;
+
+	buffer = faultaround_getbuffer();
+	if (buffer == NULL) {
+		return ENOMEM;
+	}
+
+	bzero(buffer, npages * PAGE_SIZE);
+
+	// the part of the run that comes from the file
+	fbot = (first > region->vaddr ? first : region->vaddr);
+	ftop = last + PAGE_SIZE;
+	if (ftop > region->vaddr + region->filesize) {
+		ftop = region->vaddr + region->filesize;
+	}
+
+	if (ftop > fbot) {
+		mk_kuio(&ku, buffer + (fbot - first), ftop - fbot,
+				region->offset + (off_t) (fbot - region->vaddr), UIO_READ);
+
+		result = VOP_READ(as->as_v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			/* short read; problem with executable? */
+			kprintf("ELF: short read on segment - file truncated?\n");
+			result = ENOEXEC;
+		}
+		if (result) {
+			faultaround_putbuffer(buffer);
+			return result;
+		}
+	}
+
+	for (i = 0; i < npages; i++) {
+		addr = first + i * PAGE_SIZE;
+
+		paddr = pt_get_paddr(pt, addr, 1, PAGE_R_MASK | PAGE_W_MASK) & PAGE_FRAME;
+		if (paddr == (paddr_t) NULL) {
+			faultaround_putbuffer(buffer);
+			return ENOMEM;
+		}
+
+		memmove((void *) PADDR_TO_KVADDR(paddr), buffer + i * PAGE_SIZE, PAGE_SIZE);
+
+		pt_set_permissions(pt, addr, 1, region->permissions);
+		if (addr != faultaddress) {
+			pt_set_flags(pt, addr, PAGE_PREFETCH_MASK);
+			vmstats_inc(VMSTAT_ELF_PREFETCH);
+		}
+
+		if (text) {
+			textcache_insert(as->as_v, addr, paddr);
+		}
+	}
+
+	faultaround_putbuffer(buffer);
+
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+
+	return 0;
+}
+
+/** Brings the page at faultaddress into memory, from the region if it is
+ * given and otherwise from the swapfile or as zeros. This is where a fault
+ * waits on the disk, so it is done with interrupts back at the level the
+ * fault came in at (spl) to let everything else keep running. The page is
+ * marked busy until it is in place so that nobody else touches it in the
+ * meantime. Called and returns with interrupts disabled. **/
+static int vm_pagein(struct addrspace *as, struct region *region, vaddr_t faultaddress,
+		int permissions, int spl) {
+	struct pagetable *pt = as->as_pt;
+	paddr_t paddr;
+	int result = 0;
+
+	result = pt_set_busy(pt, faultaddress);
+	if (result) {
+		return result;
+	}
+
+	splx(spl);
+
+	vm_pff(as);
+
+	if (region != NULL) {
+		result = vm_loadregion(as, region, faultaddress);
+	} else {
+		int zeroed = (pt_get_paddr(pt, faultaddress, 0, 0) & PAGE_FREE);
+
+		paddr = pt_get_paddr(pt, faultaddress, 1, permissions);
+		if ((paddr & PAGE_FRAME) == (paddr_t) NULL) {
+			result = ENOMEM;
+		} else if (zeroed) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO_WRITE);
+
+			// the entry may have come from a table made for other permissions
+			pt_set_permissions(pt, faultaddress, 0, permissions);
+		}
+	}
+
+	splhigh();
+
+	pt_clear_busy(pt, faultaddress);
+
+	return result;
+}
+
+static int vm_handlefault(int faulttype, vaddr_t faultaddress) {
 	paddr_t paddr;
 	struct addrspace *as;
-	int spl;
-	int i, nregions;
+	int spl, result;
+	int i, permissions;
 	struct region *region;
 	struct pagetable *pt;
-	vaddr_t rbot, rtop;
 	vaddr_t vaddr = faultaddress;
-
-	off_t offset;
-	size_t filesize;
-	size_t memsize;
-
-	spl = splhigh();
+	// set once the page has been brought in by this fault
+	int pagedin = 0;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -107,7 +587,6 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 	    case VM_FAULT_WRITE:
 		break;
 	    default:
-		splx(spl);
 		return EINVAL;
 	}
 
@@ -123,73 +602,144 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 
 	pt = as->as_pt;
 
+	// The page table is only looked at and changed with interrupts
+	// disabled. They are only enabled again while a page is brought in,
+	// after which the page is looked up again since pageout may have
+	// taken it back in the meantime.
+	spl = splhigh();
+
+	vm_faults += 1;
+
+retry:
 	paddr = pt_get_paddr(pt, faultaddress, 0, 0);
 
+	// someone else is moving the page, such as pageout writing it to the
+	// swapfile, so see where it ends up once they're done
+	if (pt_is_busy(pt, faultaddress)) {
+		pt_wait_busy();
+		goto retry;
+	}
+
+	// A write to a shared copy-on-write page that is already in the TLB.
+	// Give the page to this address space and fix the entry in place.
+	if (faulttype == VM_FAULT_READONLY && !(paddr & PAGE_FREE) &&
+			!(paddr & PAGE_IN_SWP) && (paddr & PAGE_COW_MASK)) {
+		paddr = pt_copy_on_write(pt, faultaddress);
+		if (paddr == (paddr_t) NULL) {
+			splx(spl);
+			return ENOMEM;
+		}
+		paddr = vm_setdirty(pt, faultaddress, paddr);
+
+		i = TLB_Probe(faultaddress | (current_asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			tlb_update(faultaddress, paddr, i);
+		} else {
+			tlb_fault(faultaddress, paddr);
+		}
+
+		splx(spl);
+		return 0;
+	}
+
+	// The first write to a writable page, which was put in the TLB
+	// read-only so we would hear about it. Fix the entry in place.
+	if (faulttype == VM_FAULT_READONLY && !(paddr & PAGE_FREE) &&
+			!(paddr & PAGE_IN_SWP) && (paddr & PAGE_W_MASK)) {
+		paddr = vm_setdirty(pt, faultaddress, paddr);
+
+		i = TLB_Probe(faultaddress | (current_asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			tlb_update(faultaddress, paddr, i);
+		} else {
+			tlb_fault(faultaddress, paddr);
+		}
+
+		splx(spl);
+		return 0;
+	}
+
+	// pages outside the regions are the stack
+	permissions = PAGE_R_MASK | PAGE_W_MASK;
+
 	if (paddr & PAGE_FREE) {
-		nregions = as->as_region_count;
-
-		for (i = 0; i < nregions; i++) {
-			region = &as->as_regions[i];
-			rbot = region->vaddr;
-			rtop = rbot + region->memsize;
-			if (vaddr < rtop && vaddr >= rbot) {
-				paddr = pt_get_paddr(pt, faultaddress, 1, PAGE_R_MASK | PAGE_W_MASK);
-
-				// Get the address into the tlb so we can write stuff from the elf
-				// file without causing another vm_fault
-				tlb_fault(faultaddress, paddr);
-
-				offset = region->offset + (off_t) (faultaddress - (region->vaddr & PAGE_FRAME));
-
-				rbot = (faultaddress > region->vaddr ? faultaddress : region->vaddr);
-				rtop = (faultaddress + PAGE_SIZE);
-
-				filesize = rtop - rbot;
-				memsize = rtop - rbot;
-
-				if (region->vaddr + region->filesize < rtop) {
-					filesize = (region->vaddr + region->filesize);
-					if (rbot <= filesize) {
-						filesize -= rbot;
-					} else {
-						filesize = 0;
-					}
-				}
-
-				if (region->vaddr + region->memsize < rtop) {
-					memsize = (region->vaddr + region->memsize);
-					if (rbot <= memsize) {
-						memsize -= rbot;
-					} else {
-						memsize = 0;
-					}
-				}
-
-				load_segment(as->as_v, offset, rbot, memsize, filesize, region->permissions & PAGE_X_MASK);
-
-				pt_set_permissions(pt, faultaddress, 1, region->permissions);
-				i = TLB_Probe(faultaddress, 0);
-				if (i >= 0) {
-					tlb_update(faultaddress, (paddr & ~(PAGE_W_MASK | PAGE_R_MASK | PAGE_X_MASK)) | region->permissions, i);
-				} else {
-					tlb_fault(faultaddress, paddr);
-				}
-
-				vmstats_inc(VMSTAT_ELF_FILE_READ);
-				vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		region = as_findregion(as, vaddr);
 
+		if (region == NULL) {
+			if (!as_isstack(faultaddress)) {
+				splx(spl);
+				return EFAULT;
+			}
+		} else if (faultaddress >= region->vaddr + region->filesize) {
+			// none of the page comes from the file (such as the
+			// heap) so it is zero-filled like any other fresh page
+			permissions = region->permissions;
+		} else {
+			result = vm_pagein(as, region, faultaddress, 0, spl);
+			if (result) {
 				splx(spl);
-				return 0;
+				return result;
 			}
+
+			pagedin = 1;
+			goto retry;
 		}
-	}
 
-	// If the page is free or in the swapfile we want to
-	// create it or load it from the swapfile
-	if (paddr & PAGE_FREE || paddr & PAGE_IN_SWP) {
-		paddr = pt_get_paddr(pt, faultaddress, 1, PAGE_R_MASK | PAGE_W_MASK);
-	} else {
+		if (faulttype == VM_FAULT_READ) {
+			// Until the page is written it reads as zeros, so
+			// map the shared zero page rather than a frame of our own
+			vm_pff(as);
+			paddr = pt_map_zero(pt, faultaddress, permissions);
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO_READ);
+
+			if ((paddr & PAGE_FRAME) == (paddr_t) NULL) {
+				splx(spl);
+				return ENOMEM;
+			}
+		} else {
+			result = vm_pagein(as, NULL, faultaddress, permissions, spl);
+			if (result) {
+				splx(spl);
+				return result;
+			}
+
+			pagedin = 1;
+			goto retry;
+		}
+	} else if (paddr & PAGE_IN_SWP) {
+		// load it back from the swapfile
+		result = vm_pagein(as, NULL, faultaddress, PAGE_R_MASK | PAGE_W_MASK, spl);
+		if (result) {
+			splx(spl);
+			return result;
+		}
+
+		pagedin = 1;
+		goto retry;
+	} else if (!pagedin) {
 		vmstats_inc(VMSTAT_TLB_RELOAD);
+
+		// the page faulted back in so it is still in use, and the
+		// refill code can reload it by itself again
+		coremap_setpagereferenced(paddr & PAGE_FRAME);
+		if (paddr & PAGE_UNREFERENCED_MASK) {
+			pt_clear_flags(pt, faultaddress, PAGE_UNREFERENCED_MASK);
+		}
+
+		// the first use of a page we loaded along with another one
+		if (paddr & PAGE_PREFETCH_MASK) {
+			vmstats_inc(VMSTAT_ELF_PREFETCH_HIT);
+			pt_clear_flags(pt, faultaddress, PAGE_PREFETCH_MASK);
+		}
+	}
+
+	// Writing to a copy-on-write page that isn't in the TLB yet
+	if (faulttype == VM_FAULT_WRITE && (paddr & PAGE_COW_MASK)) {
+		paddr = pt_copy_on_write(pt, faultaddress);
+		if (paddr == (paddr_t) NULL) {
+			splx(spl);
+			return ENOMEM;
+		}
 	}
 
 	switch (faulttype) {
@@ -210,15 +760,81 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 	    	splx(spl);
 	    	return EFAULT;
 	    }
+	    paddr = vm_setdirty(pt, faultaddress, paddr);
 		break;
 	}
 
+#if !SWAPPING_ENABLED
+	// Nothing is evicted so there's no need to hear about the first
+	// write. Count the page as dirty now so the refill code, which also
+	// wants both bits, loads it writable as well.
+	if (paddr & PAGE_W_MASK) {
+		paddr = vm_setdirty(pt, faultaddress, paddr);
+	}
+#endif
+
 	tlb_fault(faultaddress, paddr);
 	
 	splx(spl);
 	return 0;
 }
 
+/*
+ * Fills the TLB for a kernel page from vmalloc. Kernel memory can miss
+ * whatever locks are held and whatever the thread is doing, so nothing
+ * here may sleep or lock, and the entry is global so it serves every
+ * address space.
+ */
+static int vm_kernelfault(int faulttype, vaddr_t faultaddress) {
+	paddr_t paddr;
+	int spl;
+
+	faultaddress &= PAGE_FRAME;
+
+	// the entries are always writable
+	if (faulttype == VM_FAULT_READONLY) {
+		return EFAULT;
+	}
+
+	spl = splhigh();
+
+	paddr = vmalloc_getpaddr(faultaddress);
+	if (paddr == (paddr_t) NULL) {
+		splx(spl);
+		return EFAULT;
+	}
+
+	tlb_fault(faultaddress, paddr | PAGE_W_MASK | PAGE_DIRTY_MASK);
+
+	splx(spl);
+
+	return 0;
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress) {
+	struct addrspace *as;
+	int result;
+
+	// user programs can't touch kseg2, and kernel misses there are
+	// taken whether or not the thread has an address space
+	if (faultaddress >= VMALLOC_BASE) {
+		return vm_kernelfault(faulttype, faultaddress);
+	}
+
+	as = curthread->t_vmspace;
+	if (as == NULL) {
+		return vm_handlefault(faulttype, faultaddress);
+	}
+
+	// the fault looks up and fills in frames of the address space, which
+	// compaction mustn't move from under it
+	as->as_busy += 1;
+	result = vm_handlefault(faulttype, faultaddress);
+	as->as_busy -= 1;
+
+	return result;
+}
+
 vaddr_t alloc_kpages(int npages) {
 	int spl = splhigh();
 
@@ -234,6 +850,9 @@ vaddr_t alloc_kpages(int npages) {
 }
 
 void free_kpages(vaddr_t addr) {
+	// memory from vmalloc goes back through vfree
+	assert(addr < VMALLOC_BASE);
+
 	int spl = splhigh();
 
 	coremap_freepages(KVADDR_TO_PADDR(addr));
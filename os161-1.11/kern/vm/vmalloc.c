@@ -0,0 +1,166 @@
+#include <vmalloc.h>
+
+#include <coremap.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <vm.h>
+
+// marks a page whose allocation is still getting its frame
+#define VMALLOC_RESERVED 0x1
+
+#define VMALLOC_INDEX(vaddr) (((vaddr) - VMALLOC_BASE) / PAGE_SIZE)
+#define VMALLOC_VADDR(index) (VMALLOC_BASE + (index) * PAGE_SIZE)
+
+// The frame backing each page of the arena, 0 if the page is free. The
+// TLB is filled from here without locking, so an entry is only ever set
+// to a frame once nothing can use the page yet, and is cleared before its
+// TLB entry is dropped and the frame freed. Everything else is changed
+// with interrupts off, which also keeps out the coremap's own users.
+static paddr_t frames[VMALLOC_PAGES];
+
+// the number of pages allocated starting at each page, 0 if none start there
+static int lengths[VMALLOC_PAGES];
+
+// the page to start searching for free pages from
+static int vmalloc_hint = 0;
+
+static unsigned int vmalloc_pages_in_use = 0;
+
+/** Finds npages free pages in a row. Returns the index of the first or -1
+ * if there is no run long enough. Interrupts must be off. **/
+static int vmalloc_findrun(int npages) {
+	int i, run = 0;
+
+	// look from the hint on, then from the start in case pages before it
+	// have been freed, though a run can't wrap round the end
+	for (i = 0; i < VMALLOC_PAGES; i++) {
+		int page = (vmalloc_hint + i) % VMALLOC_PAGES;
+
+		if (page == 0) {
+			run = 0;
+		}
+
+		if (frames[page] != 0) {
+			run = 0;
+		} else if (++run == npages) {
+			return page - npages + 1;
+		}
+	}
+
+	return -1;
+}
+
+/** Frees the frames of the first npages pages of an allocation and then
+ * its pages. **/
+static void vmalloc_release(int start, int npages) {
+	int i, spl;
+
+	for (i = 0; i < npages; i++) {
+		paddr_t paddr = frames[start + i];
+		if (paddr == VMALLOC_RESERVED) {
+			continue;
+		}
+
+		spl = splhigh();
+		frames[start + i] = VMALLOC_RESERVED;
+		splx(spl);
+
+		vm_tlb_invalidatekernel(VMALLOC_VADDR(start + i));
+		coremap_freepages(paddr);
+	}
+
+	spl = splhigh();
+
+	for (i = 0; i < lengths[start]; i++) {
+		frames[start + i] = 0;
+	}
+	vmalloc_pages_in_use -= lengths[start];
+	lengths[start] = 0;
+
+	if (start < vmalloc_hint) {
+		vmalloc_hint = start;
+	}
+
+	splx(spl);
+}
+
+void *vmalloc(size_t size) {
+	int i, spl, start;
+	int npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	assert(npages > 0);
+
+	spl = splhigh();
+
+	start = vmalloc_findrun(npages);
+	if (start == -1) {
+		splx(spl);
+		DEBUG(DB_VM, "vmalloc: no room for %d pages.\n", npages);
+		return NULL;
+	}
+
+	// hold the pages while the frames are found, which may sleep
+	for (i = 0; i < npages; i++) {
+		frames[start + i] = VMALLOC_RESERVED;
+	}
+	lengths[start] = npages;
+	vmalloc_pages_in_use += npages;
+	vmalloc_hint = start + npages;
+
+	splx(spl);
+
+	for (i = 0; i < npages; i++) {
+		paddr_t paddr = coremap_getpages(1);
+		if (paddr == (paddr_t) NULL) {
+			vmalloc_release(start, i);
+			return NULL;
+		}
+
+		frames[start + i] = paddr;
+	}
+
+	DEBUG(DB_VM, "vmalloc: %d pages at 0x%x.\n", npages, VMALLOC_VADDR(start));
+
+	return (void *) VMALLOC_VADDR(start);
+}
+
+void vfree(void *ptr) {
+	vaddr_t vaddr = (vaddr_t) ptr;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	assert(vaddr >= VMALLOC_BASE && vaddr < VMALLOC_TOP);
+	assert(vaddr % PAGE_SIZE == 0);
+
+	int start = VMALLOC_INDEX(vaddr);
+	if (lengths[start] == 0) {
+		panic("vfree: 0x%x was not allocated by vmalloc.\n", vaddr);
+	}
+
+	DEBUG(DB_VM, "vfree: %d pages at 0x%x.\n", lengths[start], vaddr);
+
+	vmalloc_release(start, lengths[start]);
+}
+
+paddr_t vmalloc_getpaddr(vaddr_t vaddr) {
+	if (vaddr < VMALLOC_BASE || vaddr >= VMALLOC_TOP) {
+		return (paddr_t) NULL;
+	}
+
+	paddr_t paddr = frames[VMALLOC_INDEX(vaddr)];
+	if (paddr == VMALLOC_RESERVED) {
+		return (paddr_t) NULL;
+	}
+
+	return paddr;
+}
+
+void vmalloc_printstats() {
+	int spl = splhigh();
+
+	kprintf("Vmalloc: %u of %u pages in use\n", vmalloc_pages_in_use, VMALLOC_PAGES);
+
+	splx(spl);
+}
@@ -0,0 +1,95 @@
+#include <zeropool.h>
+
+#include <coremap.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <uw-vmstats.h>
+#include <vm.h>
+
+// The frames in the pool are kept on two stacks, those that have been
+// zeroed and those still waiting for the idle loop to get to them. The pool
+// is only touched with interrupts off, since the idle loop can't sleep on a
+// lock, so nothing here may sleep.
+static paddr_t clean[ZEROPOOL_PAGES];
+static paddr_t dirty[ZEROPOOL_PAGES];
+static int nclean = 0;
+static int ndirty = 0;
+
+// nonzero while frames are being given back so they aren't taken again
+static int zeropool_draining = 0;
+
+paddr_t zeropool_getpage() {
+	paddr_t paddr = (paddr_t) NULL;
+	int spl = splhigh();
+
+	if (nclean > 0) {
+		paddr = clean[--nclean];
+		_vmstats_inc(VMSTAT_ZEROPOOL_HIT);
+	} else {
+		_vmstats_inc(VMSTAT_ZEROPOOL_MISS);
+	}
+
+	splx(spl);
+
+	return paddr;
+}
+
+int zeropool_putpage(paddr_t paddr) {
+	int kept = 0;
+	int spl = splhigh();
+
+	if (!zeropool_draining && nclean + ndirty < ZEROPOOL_PAGES &&
+			coremap_getfreecount() > ZEROPOOL_MIN_FREE) {
+		dirty[ndirty++] = paddr;
+		kept = 1;
+	}
+
+	splx(spl);
+
+	return kept;
+}
+
+int zeropool_idle() {
+	paddr_t paddr;
+
+	assert(curspl > 0);
+
+	if (ndirty > 0) {
+		paddr = dirty[--ndirty];
+	} else if (nclean < ZEROPOOL_PAGES && coremap_getfreecount() > ZEROPOOL_MIN_FREE) {
+		// top the pool up from free memory while there's plenty of it
+		paddr = coremap_trygetpage();
+		if (paddr == (paddr_t) NULL) {
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+
+	bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	clean[nclean++] = paddr;
+
+	_vmstats_inc(VMSTAT_ZEROPOOL_IDLE);
+
+	return 1;
+}
+
+int zeropool_reclaim(int maxpages) {
+	int freed = 0;
+	int spl = splhigh();
+
+	zeropool_draining = 1;
+
+	// frames that still need zeroing are worth the least to us
+	while (freed < maxpages && (ndirty > 0 || nclean > 0)) {
+		paddr_t paddr = (ndirty > 0 ? dirty[--ndirty] : clean[--nclean]);
+		coremap_freepages(paddr);
+		freed += 1;
+	}
+
+	zeropool_draining = 0;
+
+	splx(spl);
+
+	return freed;
+}
@@ -0,0 +1,343 @@
+#include <zswap.h>
+
+#include <kern/errno.h>
+#include <lib.h>
+#include <swapfile.h>
+#include <uw-vmstats.h>
+#include <vm.h>
+#include <vmalloc.h>
+
+// how a kept page was compressed
+#define ZSWAP_SAME 0	// every word of the page is the same, which is stored
+#define ZSWAP_LZ 1		// see zswap_compress
+
+// the index of entries that are no longer wanted and of the filler that
+// skips the rest of the pool when an entry doesn't fit at the end
+#define ZSWAP_DEAD (-1)
+#define ZSWAP_PAD (-2)
+
+// The pool is used as a ring. New pages are added at the head and the
+// oldest are spilled from the tail, so the space of dead entries is taken
+// back once the tail gets to them. Each entry is a header followed by the
+// compressed page, rounded up so the next header stays aligned.
+struct zswap_header {
+	int index;
+	u_int16_t length;
+	u_int16_t method;
+};
+
+#define ZSWAP_ALIGN(n) (((n) + 7) & ~7)
+#define ZSWAP_SIZE (ZSWAP_POOL_PAGES * PAGE_SIZE)
+
+static char *pool = NULL;
+static unsigned int pool_head = 0;
+static unsigned int pool_tail = 0;
+static unsigned int pool_used = 0;
+
+// where the page kept for each swapfile page starts in the pool or -1
+static int offsets[SWAPFILE_MAX_PAGES];
+
+// where pages are compressed to before they are known to fit
+static unsigned char scratch[ZSWAP_MAX_LENGTH];
+
+// totals for working out how well pages compress
+static unsigned int pages_stored = 0;
+static unsigned int bytes_stored = 0;
+
+// The compressor is a plain LZ77 one. The output is groups of up to eight
+// items, each group led by a byte whose bits say which of its items are
+// matches. A literal is one byte. A match is two bytes holding how far back
+// it starts (1 to 4096) and how long it is (3 to 18).
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_DISTANCE 4096
+#define LZ_HASH_SIZE 1024
+#define LZ_NONE 0xFFFF
+
+// the last place each hash of three bytes was seen
+static u_int16_t lz_table[LZ_HASH_SIZE];
+
+void zswap_bootstrap() {
+	int i;
+
+	for (i = 0; i < SWAPFILE_MAX_PAGES; i++) {
+		offsets[i] = -1;
+	}
+
+	pool = vmalloc(ZSWAP_SIZE);
+	if (pool == NULL) panic("Unable to allocate the compressed swap pool.\n");
+}
+
+/** Compresses a page to dest, giving up if it would be longer than limit.
+ * Returns the compressed length or 0 if it gave up. **/
+static unsigned int zswap_compress(const unsigned char *src, unsigned char *dest, unsigned int limit) {
+	unsigned int in = 0, out = 0, flags = 0, items = 8;
+	unsigned int i;
+
+	for (i = 0; i < LZ_HASH_SIZE; i++) {
+		lz_table[i] = LZ_NONE;
+	}
+
+	while (in < PAGE_SIZE) {
+		if (items == 8) {
+			// make sure a whole group of matches would still fit
+			if (out + 1 + 8 * 2 > limit) {
+				return 0;
+			}
+			flags = out++;
+			dest[flags] = 0;
+			items = 0;
+		}
+
+		unsigned int length = 0, distance = 0;
+
+		if (in + LZ_MIN_MATCH <= PAGE_SIZE) {
+			unsigned int hash = ((src[in] << 6) ^ (src[in + 1] << 3) ^ src[in + 2]) % LZ_HASH_SIZE;
+			unsigned int candidate = lz_table[hash];
+			lz_table[hash] = in;
+
+			if (candidate != LZ_NONE && in - candidate <= LZ_MAX_DISTANCE) {
+				unsigned int max = PAGE_SIZE - in;
+				if (max > LZ_MAX_MATCH) {
+					max = LZ_MAX_MATCH;
+				}
+
+				while (length < max && src[candidate + length] == src[in + length]) {
+					length++;
+				}
+
+				if (length >= LZ_MIN_MATCH) {
+					distance = in - candidate;
+				} else {
+					length = 0;
+				}
+			}
+		}
+
+		if (length > 0) {
+			dest[flags] |= 1 << items;
+			dest[out++] = (distance - 1) >> 4;
+			dest[out++] = ((distance - 1) & 0xF) << 4 | (length - LZ_MIN_MATCH);
+			in += length;
+		} else {
+			dest[out++] = src[in++];
+		}
+		items++;
+	}
+
+	return out;
+}
+
+static void zswap_decompress(const unsigned char *src, unsigned int length, unsigned char *dest) {
+	unsigned int in = 0, out = 0, flags = 0, items = 8;
+	unsigned int i;
+
+	while (out < PAGE_SIZE) {
+		assert(in < length);
+
+		if (items == 8) {
+			flags = src[in++];
+			items = 0;
+		}
+
+		if (flags & (1 << items)) {
+			unsigned int distance = ((src[in] << 4) | (src[in + 1] >> 4)) + 1;
+			unsigned int count = (src[in + 1] & 0xF) + LZ_MIN_MATCH;
+			in += 2;
+
+			// byte by byte since a match can overlap what it copies
+			assert(distance <= out && out + count <= PAGE_SIZE);
+			for (i = 0; i < count; i++, out++) {
+				dest[out] = dest[out - distance];
+			}
+		} else {
+			dest[out++] = src[in++];
+		}
+		items++;
+	}
+}
+
+/** Returns the space the entry at offset takes in the pool, header
+ * included. Filler runs to the end of the pool. **/
+static unsigned int zswap_entrysize(unsigned int offset) {
+	struct zswap_header *header = (struct zswap_header *) (pool + offset);
+
+	if (header->index == ZSWAP_PAD) {
+		return ZSWAP_SIZE - offset;
+	}
+	return sizeof(struct zswap_header) + ZSWAP_ALIGN(header->length);
+}
+
+/** Moves the tail past entries that aren't wanted any more. **/
+static void zswap_trim() {
+	while (pool_used > 0) {
+		struct zswap_header *header = (struct zswap_header *) (pool + pool_tail);
+		if (header->index >= 0) {
+			break;
+		}
+
+		unsigned int size = zswap_entrysize(pool_tail);
+		pool_used -= size;
+		pool_tail += size;
+		if (pool_tail == ZSWAP_SIZE) {
+			pool_tail = 0;
+		}
+	}
+
+	if (pool_used == 0) {
+		pool_head = pool_tail = 0;
+	}
+}
+
+/** Finds size bytes at the head of the pool. Returns their offset or -1 if
+ * the pool is too full. **/
+static int zswap_alloc(unsigned int size) {
+	unsigned int offset;
+
+	if (pool_head > pool_tail || (pool_head == pool_tail && pool_used == 0)) {
+		// the free space is past the head and before the tail
+		if (size <= ZSWAP_SIZE - pool_head) {
+			offset = pool_head;
+		} else if (size <= pool_tail) {
+			struct zswap_header *pad = (struct zswap_header *) (pool + pool_head);
+			pad->index = ZSWAP_PAD;
+			pool_used += ZSWAP_SIZE - pool_head;
+			offset = 0;
+		} else {
+			return -1;
+		}
+	} else if (size <= pool_tail - pool_head) {
+		// the free space is between the head and the tail
+		offset = pool_head;
+	} else {
+		return -1;
+	}
+
+	pool_head = offset + size;
+	if (pool_head == ZSWAP_SIZE) {
+		pool_head = 0;
+	}
+	pool_used += size;
+
+	return offset;
+}
+
+int zswap_store(int index, const void *source) {
+	const u_int32_t *words = source;
+	unsigned int i, length;
+	int method;
+
+	assert(index >= 0 && index < SWAPFILE_MAX_PAGES);
+
+	if (pool == NULL) {
+		return EINVAL;
+	}
+
+	zswap_invalidate(index);
+
+	// a page of a single repeated word needs only that word
+	for (i = 1; i < PAGE_SIZE / sizeof(u_int32_t) && words[i] == words[0]; i++);
+
+	if (i == PAGE_SIZE / sizeof(u_int32_t)) {
+		memmove(scratch, words, sizeof(u_int32_t));
+		length = sizeof(u_int32_t);
+		method = ZSWAP_SAME;
+	} else {
+		length = zswap_compress(source, scratch, ZSWAP_MAX_LENGTH);
+		method = ZSWAP_LZ;
+
+		if (length == 0) {
+			vmstats_inc(VMSTAT_ZSWAP_REJECT);
+			return EINVAL;
+		}
+	}
+
+	int offset = zswap_alloc(sizeof(struct zswap_header) + ZSWAP_ALIGN(length));
+	if (offset == -1) {
+		return ENOSPC;
+	}
+
+	struct zswap_header *header = (struct zswap_header *) (pool + offset);
+	header->index = index;
+	header->length = length;
+	header->method = method;
+	memmove(header + 1, scratch, length);
+
+	offsets[index] = offset;
+
+	pages_stored += 1;
+	bytes_stored += length;
+	vmstats_inc(method == ZSWAP_SAME ? VMSTAT_ZSWAP_SAME : VMSTAT_ZSWAP_STORE);
+
+	DEBUG(DB_SWAPFILE, "Kept swapfile page %d compressed to %u bytes.\n", index, length);
+
+	return 0;
+}
+
+int zswap_load(int index, void *dest) {
+	unsigned int i;
+
+	if (pool == NULL || offsets[index] == -1) {
+		return 0;
+	}
+
+	struct zswap_header *header = (struct zswap_header *) (pool + offsets[index]);
+	assert(header->index == index);
+
+	if (header->method == ZSWAP_SAME) {
+		u_int32_t word;
+		memmove(&word, header + 1, sizeof(u_int32_t));
+		for (i = 0; i < PAGE_SIZE / sizeof(u_int32_t); i++) {
+			((u_int32_t *) dest)[i] = word;
+		}
+	} else {
+		zswap_decompress((unsigned char *) (header + 1), header->length, dest);
+	}
+
+	return 1;
+}
+
+int zswap_contains(int index) {
+	return pool != NULL && offsets[index] != -1;
+}
+
+int zswap_spill(void *dest) {
+	if (pool == NULL) {
+		return -1;
+	}
+
+	zswap_trim();
+	if (pool_used == 0) {
+		return -1;
+	}
+
+	struct zswap_header *header = (struct zswap_header *) (pool + pool_tail);
+	int index = header->index;
+
+	zswap_load(index, dest);
+	zswap_invalidate(index);
+
+	vmstats_inc(VMSTAT_ZSWAP_SPILL);
+
+	return index;
+}
+
+void zswap_invalidate(int index) {
+	if (pool == NULL || offsets[index] == -1) {
+		return;
+	}
+
+	struct zswap_header *header = (struct zswap_header *) (pool + offsets[index]);
+	header->index = ZSWAP_DEAD;
+	offsets[index] = -1;
+
+	zswap_trim();
+}
+
+unsigned int zswap_getratio() {
+	if (pages_stored == 0) {
+		return 100;
+	}
+
+	return (bytes_stored / pages_stored) * 100 / PAGE_SIZE;
+}
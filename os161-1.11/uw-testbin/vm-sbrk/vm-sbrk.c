@@ -0,0 +1,112 @@
+/*
+ * Title   : vm-sbrk
+ *
+ * Tests moving the end of the heap with sbrk: growing it, shrinking it,
+ * shrinking it below where it starts (EINVAL) and growing it into the
+ * area kept free for the stack (ENOMEM).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "../lib/testutils.h"
+
+#define PAGE_SIZE   (4096)
+#define PAGES       (8)
+
+/* These must match USERSTACK and VM_STACK_PAGES in the kernel */
+#define USERSTACK   (0x80000000)
+#define STACK_PAGES (1024)
+#define STACK_LIMIT ((int) (USERSTACK - STACK_PAGES * PAGE_SIZE))
+
+#define SBRK_FAILED ((void *) -1)
+
+int
+main()
+{
+  char *base;
+  char *brk;
+  char *p;
+  int i;
+  int errors = 0;
+  int save_errno = 0;
+
+  /* Useful for debugging, if failures occur turn verbose on by uncommenting */
+  // TEST_VERBOSE_ON();
+
+  /* The heap starts out empty */
+  base = sbrk(0);
+  TEST_NOT_EQUAL((int) base, (int) SBRK_FAILED, "sbrk(0) failed");
+  TEST_EQUAL((int) base % PAGE_SIZE, 0, "heap doesn't start on a page boundary");
+
+  /* Grow it and check every page can be written and read back */
+  p = sbrk(PAGES * PAGE_SIZE);
+  TEST_EQUAL((int) p, (int) base, "growing didn't return the old break");
+  brk = sbrk(0);
+  TEST_EQUAL((int) brk, (int) (base + PAGES * PAGE_SIZE), "break didn't move up");
+
+  for (i = 0; i < PAGES * PAGE_SIZE; i++) {
+    base[i] = (char) i;
+  }
+  for (i = 0; i < PAGES * PAGE_SIZE; i++) {
+    if (base[i] != (char) i) {
+      errors++;
+    }
+  }
+  TEST_EQUAL(errors, 0, "heap didn't keep what was written to it");
+
+  /* Shrink it by half and check the rest is untouched */
+  p = sbrk(-(PAGES / 2) * PAGE_SIZE);
+  TEST_EQUAL((int) p, (int) brk, "shrinking didn't return the old break");
+  brk = sbrk(0);
+  TEST_EQUAL((int) brk, (int) (base + (PAGES / 2) * PAGE_SIZE), "break didn't move down");
+
+  errors = 0;
+  for (i = 0; i < (PAGES / 2) * PAGE_SIZE; i++) {
+    if (base[i] != (char) i) {
+      errors++;
+    }
+  }
+  TEST_EQUAL(errors, 0, "shrinking changed what was left of the heap");
+
+  /* Pages given back and then grown into again start out as zeros */
+  p = sbrk((PAGES / 2) * PAGE_SIZE);
+  TEST_EQUAL((int) p, (int) brk, "growing again didn't return the old break");
+
+  errors = 0;
+  for (i = 0; i < (PAGES / 2) * PAGE_SIZE; i++) {
+    if (p[i] != 0) {
+      errors++;
+    }
+  }
+  TEST_EQUAL(errors, 0, "heap pages given back weren't zeroed");
+  brk = sbrk(0);
+
+  /* Shrinking below the start of the heap fails and leaves it alone */
+  p = sbrk(-(brk - base) - PAGE_SIZE);
+  save_errno = errno;
+  TEST_EQUAL((int) p, (int) SBRK_FAILED, "shrinking below the heap didn't fail");
+  TEST_EQUAL(save_errno, EINVAL, "shrinking below the heap didn't give EINVAL");
+  TEST_EQUAL((int) sbrk(0), (int) brk, "failed shrink moved the break");
+
+  /* The heap can grow right up to the stack area but not into it */
+  p = sbrk(STACK_LIMIT - (int) brk);
+  TEST_EQUAL((int) p, (int) brk, "growing up to the stack area failed");
+  TEST_EQUAL((int) sbrk(0), STACK_LIMIT, "break isn't at the stack area");
+
+  p = sbrk(PAGE_SIZE);
+  save_errno = errno;
+  TEST_EQUAL((int) p, (int) SBRK_FAILED, "growing into the stack area didn't fail");
+  TEST_EQUAL(save_errno, ENOMEM, "growing into the stack area didn't give ENOMEM");
+  TEST_EQUAL((int) sbrk(0), STACK_LIMIT, "failed grow moved the break");
+
+  /* Give it all back */
+  p = sbrk(-(STACK_LIMIT - (int) base));
+  TEST_EQUAL((int) p, STACK_LIMIT, "shrinking to empty didn't return the old break");
+  TEST_EQUAL((int) sbrk(0), (int) base, "heap isn't empty again");
+
+  TEST_STATS();
+
+  exit(0);
+}